@@ -0,0 +1,588 @@
+//
+// Created by ko on 24.12.2020.
+//
+
+/*
+ * Throughput, tail latency, peak RSS and fragmentation of the allocators on synthetic
+ * size distributions, a cross thread producer/consumer pattern and replayed traces.
+ *
+ * usage: bench [--ops N] [--threads N] [--max-pool-threads N] [--heap-profile RATE] [--record FILE] [TRACE...]
+ *
+ * Trace files have one operation per line: "a <id> <size>" allocates object id,
+ * "f <id>" frees it. --record writes the mixed synthetic trace in this format.
+ * --heap-profile turns on the heap profiler of MemoryAllocator with a sample every RATE bytes on average.
+ */
+
+#include "FixedSizeAllocator.h"
+#include "CoalesceAllocator.h"
+#include "MemoryAllocator.h"
+#include "PageAllocator.h"
+#include "ConcurrentFixedSizeAllocator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <malloc.h>
+#endif
+#ifndef WINDOWS
+#include <sys/resource.h>
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+class SystemAllocator : public AbstractAllocator {
+public:
+    void init() override {}
+
+    void destroy() override {}
+
+    void *alloc(size_t size) override {
+        return std::malloc(size);
+    }
+
+    void *allocAligned(size_t size, size_t alignment) override {
+        void *p = nullptr;
+        return posix_memalign(&p, std::max(alignment, sizeof(void *)), size) == 0 ? p : nullptr;
+    }
+
+    void free(void *p) override {
+        std::free(p);
+    }
+
+    size_t usableSize(void *p) const override {
+#ifdef __linux__
+        return malloc_usable_size(p);
+#else
+        return 0;
+#endif
+    }
+
+    AllocatorStats stats() const override {
+        return AllocatorStats(); // malloc keeps no counters of its own
+    }
+
+#ifdef DEBUG
+
+    void dumpStat() const override {}
+
+    void dumpBlock() const override {}
+
+#endif
+
+    bool isInAllocRange(void *p) const override {
+        return true;
+    }
+
+    size_t maxAllocSize() const override {
+        return (size_t) 1 << (sizeof(size_t) * 8 - 1);
+    }
+};
+
+// any allocator made thread safe by one mutex around every call
+class LockedAllocator : public AbstractAllocator {
+    AbstractAllocator &allocator;
+    mutable std::mutex mutex;
+
+public:
+    explicit LockedAllocator(AbstractAllocator &allocator) : allocator(allocator) {}
+
+    void init() override {
+        allocator.init();
+    }
+
+    void destroy() override {
+        allocator.destroy();
+    }
+
+    void *alloc(size_t size) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        return allocator.alloc(size);
+    }
+
+    void *allocAligned(size_t size, size_t alignment) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        return allocator.allocAligned(size, alignment);
+    }
+
+    void free(void *p) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        allocator.free(p);
+    }
+
+    size_t usableSize(void *p) const override {
+        std::lock_guard<std::mutex> lock(mutex);
+        return allocator.usableSize(p);
+    }
+
+    AllocatorStats stats() const override {
+        std::lock_guard<std::mutex> lock(mutex);
+        return allocator.stats();
+    }
+
+#ifdef DEBUG
+
+    void dumpStat() const override {}
+
+    void dumpBlock() const override {}
+
+#endif
+
+    bool isInAllocRange(void *p) const override {
+        return allocator.isInAllocRange(p);
+    }
+
+    size_t maxAllocSize() const override {
+        return allocator.maxAllocSize();
+    }
+};
+
+struct Operation {
+    bool isAlloc;
+    size_t id;
+    size_t size;
+};
+
+struct Trace {
+    std::string name;
+    std::vector<Operation> ops;
+    size_t slots = 0; // ids are below slots
+    size_t maxSize = 0;
+    size_t peakOp = 0; // operation after which live bytes are at their peak
+};
+
+struct Result {
+    double opsPerSec = 0;
+    double p99 = 0; // nanoseconds
+    size_t peakRssKb = 0; // above the resident set before the run
+    double fragmentation = -1; // at the peak of live bytes, negative if unknown
+};
+
+static void finishTrace(Trace &trace) {
+    size_t live = 0, peak = 0;
+    std::vector<size_t> sizes;
+    for (size_t i = 0; i < trace.ops.size(); i++) {
+        const Operation &op = trace.ops[i];
+        trace.slots = std::max(trace.slots, op.id + 1);
+        sizes.resize(trace.slots);
+        if (op.isAlloc) {
+            sizes[op.id] = op.size;
+            live += op.size;
+            trace.maxSize = std::max(trace.maxSize, op.size);
+        } else {
+            live -= sizes[op.id];
+        }
+        if (live > peak) {
+            peak = live;
+            trace.peakOp = i;
+        }
+    }
+}
+
+/*
+ * Allocates a bit more often than frees until liveObjects objects are alive, then keeps
+ * about that many alive, frees everything left at the end
+ */
+static Trace randomTrace(const std::string &name, size_t ops, size_t liveObjects,
+                         const std::function<size_t(std::mt19937_64 &)> &size) {
+    Trace trace;
+    trace.name = name;
+    std::mt19937_64 rng(0x5eed);
+    std::vector<size_t> live, freeIds;
+    size_t nextId = 0;
+    for (size_t i = 0; i < ops; i++) {
+        if (!live.empty() && (live.size() >= liveObjects || rng() % 5 < 2)) {
+            size_t j = rng() % live.size();
+            trace.ops.push_back({false, live[j], 0});
+            freeIds.push_back(live[j]);
+            live[j] = live.back();
+            live.pop_back();
+        } else {
+            size_t id = nextId;
+            if (freeIds.empty()) nextId++;
+            else id = freeIds.back(), freeIds.pop_back();
+            trace.ops.push_back({true, id, size(rng)});
+            live.push_back(id);
+        }
+    }
+    for (size_t id : live) {
+        trace.ops.push_back({false, id, 0});
+    }
+    finishTrace(trace);
+    return trace;
+}
+
+// log-uniform size in [from, to)
+static size_t logUniform(std::mt19937_64 &rng, size_t from, size_t to) {
+    std::uniform_real_distribution<double> d(std::log((double) from), std::log((double) to));
+    return (size_t) std::exp(d(rng));
+}
+
+static bool loadTrace(const std::string &path, Trace &trace) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    trace.name = path;
+    std::string kind;
+    while (in >> kind) {
+        Operation op{kind == "a", 0, 0};
+        in >> op.id;
+        if (op.isAlloc) in >> op.size;
+        trace.ops.push_back(op);
+    }
+    finishTrace(trace);
+    return true;
+}
+
+static void saveTrace(const std::string &path, const Trace &trace) {
+    std::ofstream out(path);
+    for (const Operation &op : trace.ops) {
+        if (op.isAlloc) out << "a " << op.id << ' ' << op.size << '\n';
+        else out << "f " << op.id << '\n';
+    }
+}
+
+// resets the peak of the resident set where the OS allows it
+static void resetPeakRss() {
+#ifdef __linux__
+    std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+static size_t statusKb(const char *field) {
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    size_t length = std::strlen(field);
+    while (std::getline(status, line)) {
+        if (line.compare(0, length, field) == 0) {
+            return std::strtoull(line.c_str() + length, nullptr, 10);
+        }
+    }
+#endif
+    return 0;
+}
+
+static size_t rssKb() {
+    return statusKb("VmRSS:");
+}
+
+static size_t peakRssKb() {
+#ifdef __linux__
+    return statusKb("VmHWM:");
+#endif
+#ifndef WINDOWS
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (size_t) usage.ru_maxrss;
+#else
+    return 0;
+#endif
+}
+
+static double percentile(std::vector<uint32_t> &samples, double q) {
+    if (samples.empty()) {
+        return 0;
+    }
+    size_t k = std::min(samples.size() - 1, (size_t) (q * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+    return samples[k];
+}
+
+static const size_t LATENCY_SAMPLE_PERIOD = 16;
+
+static Result replay(AbstractAllocator &a, const Trace &trace) {
+    Result result;
+    std::vector<void *> slots(trace.slots);
+    std::vector<uint32_t> latencies;
+    latencies.reserve(trace.ops.size() / LATENCY_SAMPLE_PERIOD + 1);
+    resetPeakRss();
+    size_t baseRss = rssKb();
+    a.init();
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < trace.ops.size(); i++) {
+        const Operation &op = trace.ops[i];
+        bool sampled = i % LATENCY_SAMPLE_PERIOD == 0;
+        Clock::time_point opStart;
+        if (sampled) opStart = Clock::now();
+        if (op.isAlloc) {
+            byte *p = static_cast<byte *>(a.alloc(op.size));
+            if (op.size > 0) p[0] = p[op.size - 1] = 1; // objects are touched like real ones
+            slots[op.id] = p;
+        } else {
+            a.free(slots[op.id]);
+        }
+        if (sampled) {
+            latencies.push_back((uint32_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    Clock::now() - opStart).count());
+        }
+        if (i == trace.peakOp) {
+            Clock::time_point pause = Clock::now();
+            AllocatorStats stats = a.stats();
+            if (stats.bytesMapped > 0) result.fragmentation = stats.fragmentation();
+            start += Clock::now() - pause;
+        }
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.peakRssKb = std::max(peakRssKb(), baseRss) - baseRss;
+    a.destroy();
+    result.opsPerSec = trace.ops.size() / seconds;
+    result.p99 = percentile(latencies, 0.99);
+    return result;
+}
+
+/*
+ * Producers allocate, consumers free the objects of producers in batches passed through a queue,
+ * so almost every free is a remote free of a block allocated by another thread
+ */
+static Result producerConsumer(AbstractAllocator &a, size_t ops, size_t threads) {
+    static const size_t BATCH = 64;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::vector<void *>> queue;
+    size_t producersLeft = threads;
+    std::vector<std::vector<uint32_t>> latencies(2 * threads);
+    size_t perThread = ops / (2 * threads) / BATCH * BATCH;
+
+    auto timed = [](std::vector<uint32_t> &samples, size_t i, const std::function<void()> &op) {
+        if (i % LATENCY_SAMPLE_PERIOD != 0) {
+            op();
+            return;
+        }
+        Clock::time_point opStart = Clock::now();
+        op();
+        samples.push_back((uint32_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now() - opStart).count());
+    };
+
+    Result result;
+    resetPeakRss();
+    size_t baseRss = rssKb();
+    a.init();
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            std::mt19937_64 rng(t);
+            std::vector<void *> batch;
+            for (size_t i = 0; i < perThread; i++) {
+                size_t size = logUniform(rng, 8, 1024);
+                timed(latencies[t], i, [&]() { batch.push_back(a.alloc(size)); });
+                static_cast<byte *>(batch.back())[0] = 1;
+                if (batch.size() == BATCH) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    queue.push_back(std::move(batch));
+                    batch.clear();
+                    ready.notify_one();
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            producersLeft--;
+            ready.notify_all();
+        });
+        workers.emplace_back([&, t]() {
+            size_t i = 0;
+            while (true) {
+                std::vector<void *> batch;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [&]() { return !queue.empty() || producersLeft == 0; });
+                    if (queue.empty()) break;
+                    batch = std::move(queue.front());
+                    queue.pop_front();
+                }
+                for (void *p : batch) {
+                    timed(latencies[threads + t], i++, [&]() { a.free(p); });
+                }
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.peakRssKb = std::max(peakRssKb(), baseRss) - baseRss;
+    a.destroy();
+    std::vector<uint32_t> all;
+    for (std::vector<uint32_t> &samples : latencies) {
+        all.insert(all.end(), samples.begin(), samples.end());
+    }
+    result.opsPerSec = 2.0 * perThread * threads / seconds;
+    result.p99 = percentile(all, 0.99);
+    return result;
+}
+
+/*
+ * Every thread builds and tears down its own batches of nodes from one shared pool,
+ * the only contention is on the pool itself
+ */
+static Result nodePool(AbstractAllocator &a, size_t ops, size_t threads, size_t nodeSize) {
+    static const size_t BATCH = 256;
+    size_t batches = std::max((size_t) 1, ops / threads / (2 * BATCH));
+    std::vector<std::vector<uint32_t>> latencies(threads);
+
+    Result result;
+    resetPeakRss();
+    size_t baseRss = rssKb();
+    a.init();
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            std::vector<void *> nodes(BATCH);
+            size_t i = 0;
+            for (size_t b = 0; b < batches; b++) {
+                for (void *&node : nodes) {
+                    if (i++ % LATENCY_SAMPLE_PERIOD != 0) {
+                        node = a.alloc(nodeSize);
+                        continue;
+                    }
+                    Clock::time_point opStart = Clock::now();
+                    node = a.alloc(nodeSize);
+                    latencies[t].push_back((uint32_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            Clock::now() - opStart).count());
+                }
+                for (void *node : nodes) {
+                    static_cast<byte *>(node)[nodeSize - 1] = 1;
+                }
+                // every node of the batch is live, the pool is sampled there once, mid run
+                if (t == 0 && b == batches / 2) {
+                    AllocatorStats stats = a.stats();
+                    if (stats.bytesMapped > 0) result.fragmentation = stats.fragmentation();
+                }
+                for (void *node : nodes) {
+                    a.free(node);
+                }
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.peakRssKb = std::max(peakRssKb(), baseRss) - baseRss;
+    a.destroy();
+    std::vector<uint32_t> all;
+    for (std::vector<uint32_t> &samples : latencies) {
+        all.insert(all.end(), samples.begin(), samples.end());
+    }
+    result.opsPerSec = 2.0 * batches * BATCH * threads / seconds;
+    result.p99 = percentile(all, 0.99); // of allocs
+    return result;
+}
+
+static void printHeader() {
+    std::printf("%-24s %-12s %14s %10s %12s %14s\n", "workload", "allocator", "ops/sec", "p99 ns", "peak RSS MB",
+                "fragmentation");
+}
+
+static void printResult(const std::string &workload, const char *allocator, const Result &r) {
+    char fragmentation[32] = "-";
+    if (r.fragmentation >= 0) std::snprintf(fragmentation, sizeof(fragmentation), "%.3f", r.fragmentation);
+    std::printf("%-24s %-12s %14.0f %10.0f %12.1f %14s\n", workload.c_str(), allocator, r.opsPerSec, r.p99,
+                r.peakRssKb / 1024.0, fragmentation);
+    std::fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    size_t ops = 2000000, threads = 4, maxPoolThreads = 64, heapProfileRate = 0;
+    std::string record;
+    std::vector<Trace> traces;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--ops" && i + 1 < argc) {
+            ops = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::max((size_t) 1, (size_t) std::strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--max-pool-threads" && i + 1 < argc) {
+            maxPoolThreads = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--heap-profile" && i + 1 < argc) {
+            heapProfileRate = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--record" && i + 1 < argc) {
+            record = argv[++i];
+        } else {
+            Trace trace;
+            if (!loadTrace(arg, trace)) {
+                std::cerr << "can not read trace " << arg << std::endl;
+                return 1;
+            }
+            traces.push_back(std::move(trace));
+        }
+    }
+
+    std::vector<Trace> synthetic;
+    synthetic.push_back(randomTrace("fixed 64", ops, 100000, [](std::mt19937_64 &) {
+        return (size_t) 64;
+    }));
+    synthetic.push_back(randomTrace("small 8..512", ops, 100000, [](std::mt19937_64 &rng) {
+        return logUniform(rng, 8, 512);
+    }));
+    // churn of a few big buffers, every one of them is a large block
+    synthetic.push_back(randomTrace("buffers 16..64M", std::max(ops / 1000, (size_t) 100), 4,
+                                    [](std::mt19937_64 &rng) {
+                                        return ((size_t) 16 << 20) + rng() % ((size_t) 48 << 20);
+                                    }));
+    // mostly small objects with a tail of buffers, as in a typical server heap
+    synthetic.push_back(randomTrace("mixed 8..4M", ops, 20000, [](std::mt19937_64 &rng) {
+        size_t kind = rng() % 100;
+        return kind < 90 ? logUniform(rng, 8, 256) : kind < 99 ? logUniform(rng, 1024, 65536)
+                                                               : logUniform(rng, 262144, 4194304);
+    }));
+    if (!record.empty()) {
+        saveTrace(record, synthetic.back());
+    }
+    synthetic.insert(synthetic.end(), traces.begin(), traces.end());
+
+    printHeader();
+    for (const Trace &trace : synthetic) {
+        // malloc goes first, memory it keeps for reuse does not count against the others then
+        SystemAllocator sa;
+        printResult(trace.name, "malloc", replay(sa, trace));
+        if (trace.maxSize <= 512) {
+            FixedSizeAllocator fsa(std::max((size_t) 16, (trace.maxSize + 7) / 8 * 8));
+            printResult(trace.name, "fixed", replay(fsa, trace));
+        }
+        CoalesceAllocator ca;
+        if (trace.maxSize < ca.maxAllocSize()) {
+            printResult(trace.name, "coalesce", replay(ca, trace));
+        }
+        MemoryAllocator ma;
+        ma.heapProfiler().setSampleRate(heapProfileRate);
+        printResult(trace.name, "memory", replay(ma, trace));
+    }
+    // fixed size and coalesce allocators are not thread safe, only the others take part
+    std::string workload = "producer/consumer x" + std::to_string(threads);
+    SystemAllocator sa;
+    printResult(workload, "malloc", producerConsumer(sa, ops, threads));
+    MemoryAllocator ma;
+    ma.heapProfiler().setSampleRate(heapProfileRate);
+    printResult(workload, "memory", producerConsumer(ma, ops, threads));
+
+    // lock free pool against the same fixed size allocator behind a mutex
+    for (size_t poolThreads = 1; poolThreads <= maxPoolThreads; poolThreads *= 2) {
+        std::string pool = "node pool 64B x" + std::to_string(poolThreads);
+        ConcurrentFixedSizeAllocator concurrent(64);
+        printResult(pool, "lock-free", nodePool(concurrent, ops, poolThreads, 64));
+        FixedSizeAllocator fsa(64);
+        LockedAllocator locked(fsa);
+        printResult(pool, "mutex", nodePool(locked, ops, poolThreads, 64));
+    }
+    return 0;
+}
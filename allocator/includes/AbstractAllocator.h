@@ -5,7 +5,11 @@
 #ifndef ALLOCATOR_ABSTRACTALLOCATOR_H
 #define ALLOCATOR_ABSTRACTALLOCATOR_H
 
+#include <algorithm>
 #include <cstddef>
+#include <cstring>
+
+#include "AllocatorStats.h"
 
 typedef unsigned char byte;
 
@@ -13,6 +17,28 @@ inline byte *toByte(void *p) {
     return reinterpret_cast<byte *>(p);
 }
 
+// index of the highest set bit, v must not be zero
+inline size_t highestBit(size_t v) {
+#if defined(__GNUC__)
+    return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(v);
+#else
+    size_t i = 0;
+    while (v >>= 1) i++;
+    return i;
+#endif
+}
+
+// index of the lowest set bit, v must not be zero
+inline size_t lowestBit(size_t v) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(v);
+#else
+    size_t i = 0;
+    while (!(v & 1)) v >>= 1, i++;
+    return i;
+#endif
+}
+
 class AbstractAllocator {
 public:
     virtual ~AbstractAllocator() {}
@@ -23,8 +49,36 @@ public:
 
     virtual void *alloc(size_t size) = 0;
 
+    // block which address is a multiple of alignment (a power of two), released with free as any other
+    virtual void *allocAligned(size_t size, size_t alignment) = 0;
+
     virtual void free(void *p) = 0;
 
+    // bytes of the block p which may be used, at least the size it was allocated with
+    virtual size_t usableSize(void *p) const = 0;
+
+    // grows or shrinks block p to size without moving it, false if it has to move
+    virtual bool tryExpandInPlace(void *p, size_t size) {
+        return size <= usableSize(p);
+    }
+
+    // resizes block p keeping its content, moves it only when it can not be resized in place
+    virtual void *realloc(void *p, size_t size) {
+        if (p == nullptr) {
+            return alloc(size);
+        }
+        if (tryExpandInPlace(p, size)) {
+            return p;
+        }
+        void *newBlock = alloc(size);
+        memcpy(newBlock, p, std::min(usableSize(p), size));
+        free(p);
+        return newBlock;
+    }
+
+    // counters are always on, the snapshot is cheap enough to be scraped periodically
+    virtual AllocatorStats stats() const = 0;
+
 #ifdef DEBUG
 
     virtual void dumpStat() const = 0;
@@ -0,0 +1,52 @@
+//
+// Created by ko on 22.12.2020.
+//
+
+#ifndef ALLOCATOR_ALLOCATORSTATS_H
+#define ALLOCATOR_ALLOCATORSTATS_H
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * Snapshot of always on counters of one allocator or one size class
+ */
+struct AllocatorStats {
+    size_t allocs = 0;
+    size_t frees = 0;
+    size_t bytesLive = 0; // bytes of blocks handed out and not freed yet, headers included
+    size_t peakBytesLive = 0;
+    size_t pages = 0;
+    size_t bytesMapped = 0; // bytes of pages taken from the OS
+    size_t slowPathHits = 0; // operations which had to take a new page or go to a shared arena
+
+    // share of mapped memory which is not in live blocks
+    double fragmentation() const {
+        return bytesMapped == 0 ? 0 : 1.0 - (double) bytesLive / (double) bytesMapped;
+    }
+
+    AllocatorStats &operator+=(const AllocatorStats &other) {
+        allocs += other.allocs;
+        frees += other.frees;
+        bytesLive += other.bytesLive;
+        peakBytesLive += other.peakBytesLive;
+        pages += other.pages;
+        bytesMapped += other.bytesMapped;
+        slowPathHits += other.slowPathHits;
+        return *this;
+    }
+};
+
+struct SizeClassStats : AllocatorStats {
+    size_t blockSize = 0;
+};
+
+struct MemoryAllocatorStats {
+    std::vector<SizeClassStats> sizeClasses;
+    AllocatorStats coalesce;
+    AllocatorStats page;
+    std::vector<AllocatorStats> nodes; // fixed size and coalesce arenas of every NUMA node
+    AllocatorStats total;
+};
+
+#endif //ALLOCATOR_ALLOCATORSTATS_H
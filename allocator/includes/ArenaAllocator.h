@@ -0,0 +1,290 @@
+//
+// Created by ko on 25.12.2020.
+//
+
+#ifndef ALLOCATOR_ARENAALLOCATOR_H
+#define ALLOCATOR_ARENAALLOCATOR_H
+
+#include "AbstractAllocator.h"
+#include "NativePageAllocator.h"
+#include "AllocatorStats.h"
+
+#include <cassert>
+#include <cstdint>
+
+#ifdef DEBUG
+#include <iostream>
+#endif
+
+/*
+ * Monotonic allocator: alloc bumps a pointer, free does nothing, memory comes back all at once
+ * by reset or by rollback to a checkpoint. Pages are kept by reset and rollback and reused
+ * by the next allocations, they are returned to the OS only by destroy.
+ */
+class ArenaAllocator : public AbstractAllocator {
+private:
+    struct MemPage {
+        MemPage *nextPage;
+        size_t size; // with the header
+    };
+
+    // lies right before user data and keeps the size of the block, so realloc can copy it
+    struct Block {
+        size_t size;
+    };
+
+public:
+    static const size_t DEFAULT_PAGE_SIZE = 1 << 20;
+    // user data of every block is aligned to it
+    static const size_t ALIGNMENT = 16;
+
+    /*
+     * State of the arena to roll back to. Rolling back to a checkpoint frees everything allocated
+     * after it and invalidates checkpoints taken after it.
+     */
+    class Checkpoint {
+        friend class ArenaAllocator;
+
+        MemPage *page;
+        byte *top;
+        size_t bytesLive;
+
+        Checkpoint(MemPage *page, byte *top, size_t bytesLive) : page(page), top(top), bytesLive(bytesLive) {}
+    };
+
+    // rolls the arena back to the state it had when the scope was opened
+    class Scope {
+        ArenaAllocator &arena;
+        Checkpoint checkpoint;
+
+    public:
+        explicit Scope(ArenaAllocator &arena) : arena(arena), checkpoint(arena.checkpoint()) {}
+
+        Scope(const Scope &scope) = delete;
+
+        ~Scope() {
+            arena.rollback(checkpoint);
+        }
+    };
+
+private:
+    // the first header lies sizeof(Block) below an aligned address
+    static const size_t FIRST_BLOCK_OFFSET = (sizeof(MemPage) + sizeof(Block) + ALIGNMENT - 1)
+                                             / ALIGNMENT * ALIGNMENT - sizeof(Block);
+
+    const size_t pageSize;
+    MemPage *mem = nullptr; // pages in the order of use
+    MemPage *current = nullptr;
+    // top is sizeof(Block) below an aligned address, so user data right after the block header is aligned
+    byte *top = nullptr;
+    byte *end = nullptr;
+    AllocatorStats counters;
+
+private:
+    static inline uintptr_t alignUp(uintptr_t v, size_t alignment) {
+        return (v + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    }
+
+    static inline byte *pageBegin(MemPage *page) {
+        return toByte(page) + FIRST_BLOCK_OFFSET;
+    }
+
+    static inline byte *pageEnd(MemPage *page) {
+        return toByte(page) + page->size;
+    }
+
+    inline void usePage(MemPage *page) {
+        current = page;
+        top = pageBegin(page);
+        end = pageEnd(page);
+    }
+
+    // maps a page after the current one, pages which follow it are still reused later
+    MemPage *newPage(size_t need) {
+        size_t size = std::max(pageSize, need + FIRST_BLOCK_OFFSET);
+        size = alignUp(size, systemPageSize());
+        MemPage *page = allocPage<MemPage>(size);
+        page->size = size;
+        if (current == nullptr) {
+            page->nextPage = mem;
+            mem = page;
+        } else {
+            page->nextPage = current->nextPage;
+            current->nextPage = page;
+        }
+        counters.pages++;
+        counters.bytesMapped += size;
+        return page;
+    }
+
+    // finds a place for need bytes starting with a block header in the next pages
+    byte *allocSlow(size_t need, size_t alignment) {
+        counters.slowPathHits++;
+        size_t worst = need + alignment; // enough for any position of the header
+        MemPage *page = current->nextPage;
+        if (page == nullptr || pageEnd(page) - pageBegin(page) < (ptrdiff_t) worst) {
+            page = newPage(worst);
+        }
+        usePage(page);
+        byte *header = placeBlock(need, alignment);
+        assert(header != nullptr);
+        return header;
+    }
+
+    // header position in the current page for user data aligned to alignment, nullptr if it does not fit
+    inline byte *placeBlock(size_t need, size_t alignment) {
+        byte *header = toByte(reinterpret_cast<void *>(
+                alignUp(reinterpret_cast<uintptr_t>(top) + sizeof(Block), alignment) - sizeof(Block)));
+        if (header > end || need > (size_t) (end - header)) {
+            return nullptr;
+        }
+        return header;
+    }
+
+public:
+    explicit ArenaAllocator(size_t pageSize = DEFAULT_PAGE_SIZE) : pageSize(pageSize) {}
+
+    ~ArenaAllocator() {
+        assert(mem == nullptr);
+        if (mem != nullptr) {
+            destroy();
+        }
+    }
+
+    void init() override {
+        assert(mem == nullptr);
+        usePage(newPage(pageSize));
+    }
+
+    void destroy() override final {
+        assert(mem != nullptr);
+        while (mem != nullptr) {
+            MemPage *page = mem;
+            mem = mem->nextPage;
+            freePage(page, page->size);
+        }
+        current = nullptr;
+        top = end = nullptr;
+        counters = AllocatorStats();
+    }
+
+    void *alloc(size_t size) override {
+        return allocAligned(size, ALIGNMENT);
+    }
+
+    void *allocAligned(size_t size, size_t alignment) override {
+        assert(mem != nullptr);
+        assert(alignment && !(alignment & (alignment - 1)));
+        if (alignment < ALIGNMENT) alignment = ALIGNMENT;
+        // the next header stays right before an aligned address
+        size_t need = alignUp(size + sizeof(Block), ALIGNMENT);
+        byte *header = placeBlock(need, alignment);
+        if (header == nullptr) {
+            header = allocSlow(need, alignment);
+        }
+        Block *block = reinterpret_cast<Block *>(header);
+        block->size = need - sizeof(Block);
+        top = header + need;
+        counters.allocs++;
+        counters.bytesLive += need;
+        counters.peakBytesLive = std::max(counters.peakBytesLive, counters.bytesLive);
+        return block + 1;
+    }
+
+    // memory of the block comes back only with reset or rollback
+    void free(void *p) override {
+        counters.frees++;
+    }
+
+    size_t usableSize(void *p) const override {
+        return (reinterpret_cast<Block *>(p) - 1)->size;
+    }
+
+    // only the last block grows, any block shrinks without giving the memory back
+    bool tryExpandInPlace(void *p, size_t size) override {
+        Block *block = reinterpret_cast<Block *>(p) - 1;
+        if (size <= block->size) {
+            return true;
+        }
+        size_t need = alignUp(size + sizeof(Block), ALIGNMENT) - sizeof(Block);
+        if (toByte(p) + block->size != top || need - block->size > (size_t) (end - top)) {
+            return false;
+        }
+        top += need - block->size;
+        counters.bytesLive += need - block->size;
+        counters.peakBytesLive = std::max(counters.peakBytesLive, counters.bytesLive);
+        block->size = need;
+        return true;
+    }
+
+    Checkpoint checkpoint() const {
+        return Checkpoint(current, top, counters.bytesLive);
+    }
+
+    void rollback(const Checkpoint &checkpoint) {
+#ifdef DEBUG
+        bool found = false;
+        for (MemPage *page = mem; page != current->nextPage; page = page->nextPage) {
+            found |= page == checkpoint.page;
+        }
+        assert(found); // the checkpoint is not taken after the current position
+        assert(checkpoint.page != current || checkpoint.top <= top);
+#endif
+        current = checkpoint.page;
+        top = checkpoint.top;
+        end = pageEnd(current);
+        counters.bytesLive = checkpoint.bytesLive;
+    }
+
+    // frees every block, the pages are kept for reuse
+    void reset() {
+        assert(mem != nullptr);
+        usePage(mem);
+        counters.bytesLive = 0;
+    }
+
+    size_t pagesCount() const {
+        return counters.pages;
+    }
+
+    AllocatorStats stats() const override {
+        return counters;
+    }
+
+#ifdef DEBUG
+
+    void dumpStat() const override {
+        std::cout << "Blocks allocated: " << counters.allocs << std::endl;
+        std::cout << "Memory consumed: " << counters.bytesLive << " / " << counters.bytesMapped << std::endl;
+        std::cout << "Consumed OS blocks: " << counters.pages << std::endl;
+        for (MemPage *page = mem; page != nullptr; page = page->nextPage) {
+            std::cout << "page " << (void *) page << ' ' << page->size << (page == current ? " current" : "")
+                      << std::endl;
+        }
+    }
+
+    // blocks are not linked, so only the used part of every page is shown
+    void dumpBlock() const override {
+        for (MemPage *page = mem; page != current->nextPage; page = page->nextPage) {
+            byte *pageTop = page == current ? top : pageEnd(page);
+            std::cout << (void *) pageBegin(page) << ' ' << pageTop - pageBegin(page) << std::endl;
+        }
+    }
+
+#endif
+
+    bool isInAllocRange(void *p) const override {
+        for (MemPage *page = mem; page != nullptr; page = page->nextPage) {
+            if (pageBegin(page) < toByte(p) && toByte(p) < pageEnd(page)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t maxAllocSize() const override {
+        return (size_t) 1 << (sizeof(size_t) * 8 - 2);
+    }
+};
+
+#endif //ALLOCATOR_ARENAALLOCATOR_H
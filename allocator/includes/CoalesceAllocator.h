@@ -5,6 +5,13 @@
 #ifndef ALLOCATOR_COALESCEALLOCATOR_H
 #define ALLOCATOR_COALESCEALLOCATOR_H
 
+#include "AbstractAllocator.h"
+#include "NativePageAllocator.h"
+#include "Numa.h"
+#include "PageMap.h"
+#include "AllocatorStats.h"
+#include "Hardening.h"
+
 #ifdef DEBUG
 #include <iostream>
 #endif
@@ -31,6 +38,8 @@ private:
         return v & flag;
     }
 
+    struct FreeLists;
+
     struct Block {
         size_t flaggedSize;
 
@@ -73,25 +82,16 @@ private:
             *endSize = newSize;
         }
 
-        void removeFromList(FreeBlock **head) {
-            if (prev) prev->next = next;
-            if (next) next->prev = prev;
-            if (*head == this) {
-                *head = next;
-            }
-        }
-
-        Block *takeBlock(size_t blockSize, FreeBlock **head) {
+        Block *takeBlock(size_t blockSize, FreeLists *lists) {
+            lists->remove(this);
             size_t restSize = getValue(flaggedSize) - blockSize;
             if (restSize >= MIN_SIZE) {
                 FreeBlock *newBlock = reinterpret_cast<FreeBlock *>(toByte(this) + blockSize);
-                newBlock->next = next;
-                if (next) next->prev = newBlock;
                 newBlock->setSize(restSize, 0);
 #ifdef DEBUG
                 newBlock->value = 0x5afe;
 #endif
-                next = newBlock;
+                lists->insert(newBlock);
             } else {
                 blockSize = getValue(flaggedSize);
             }
@@ -99,66 +99,173 @@ private:
             if (*right_size != 0) {
                 *right_size |= LEFT_CONSUMED;
             }
-            removeFromList(head);
             Block *block = reinterpret_cast<Block *>(this);
             block->flaggedSize = setFlag(blockSize, getFlag(flaggedSize, LEFT_CONSUMED) | IS_CONSUMED);
             return block;
         }
 
-        FreeBlock *joinRight(FreeBlock **head) {
+        // this block must not be in the lists, its size changes
+        FreeBlock *joinRight(FreeLists *lists) {
             FreeBlock *right = rightBlock();
             if (right == nullptr) return this;
+            lists->remove(right);
             setSize(getValue(flaggedSize) + getValue(right->flaggedSize), getFlag(flaggedSize, LEFT_CONSUMED));
-            right->removeFromList(head);
             return this;
         }
     };
 
+    /*
+     * Segregated free lists: bin i holds free blocks with size in [2^i, 2^(i + 1)),
+     * bit i of nonEmpty is set iff bin i is not empty
+     */
+    struct FreeLists {
+        static const size_t BINS = 30;
+
+        size_t nonEmpty = 0;
+        FreeBlock *heads[BINS];
+
+        FreeLists() {
+            clear();
+        }
+
+        void clear() {
+            nonEmpty = 0;
+            for (size_t i = 0; i < BINS; i++) {
+                heads[i] = nullptr;
+            }
+        }
+
+        void insert(FreeBlock *block) {
+            size_t bin = highestBit(getValue(block->flaggedSize));
+            block->prev = nullptr;
+            block->next = heads[bin];
+            if (heads[bin]) heads[bin]->prev = block;
+            heads[bin] = block;
+            nonEmpty |= (size_t) 1 << bin;
+        }
+
+        void remove(FreeBlock *block) {
+            size_t bin = highestBit(getValue(block->flaggedSize));
+            if (block->prev) block->prev->next = block->next;
+            if (block->next) block->next->prev = block->prev;
+            if (heads[bin] == block) {
+                heads[bin] = block->next;
+                if (heads[bin] == nullptr) nonEmpty &= ~((size_t) 1 << bin);
+            }
+        }
+
+        FreeBlock *find(size_t size) {
+            size_t bin = highestBit(size);
+            // any block from a bin above the size bin fits, so the first one is taken
+            size_t above = bin + 1 < BINS ? nonEmpty & ~(((size_t) 2 << bin) - 1) : 0;
+            if (above != 0) {
+                return heads[lowestBit(above)];
+            }
+            // blocks of the size bin may be smaller than size, first fit among them
+            for (FreeBlock *block = heads[bin]; block != nullptr; block = block->next) {
+                if (getValue(block->flaggedSize) >= size) {
+                    return block;
+                }
+            }
+            return nullptr;
+        }
+    };
+
     struct MemPage {
+        MemPage *prevPage;
         MemPage *nextPage;
-        size_t freeBlockEndSize;
+        size_t decommitted; // page is empty and memory behind its only free block is returned to the OS
     };
 
     static const size_t PAGE_SIZE = 1 << 24;
-    static const size_t DATA_SIZE = PAGE_SIZE - sizeof(MemPage) - sizeof(size_t);
-    static const size_t MIN_SIZE = sizeof(FreeBlock) + sizeof(size_t);
+
+public:
+    // user data of every block is aligned to it
+    static const size_t ALIGNMENT = 16;
 
 private:
-    MemPage *mem = nullptr;
-    FreeBlock *freeBlocksHead = nullptr;
+    static inline size_t alignUp(size_t size) {
+        return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
 
-#ifdef DEBUG
-    size_t blocksCount = 0;
-    size_t consumed_memory = 0;
-#endif
+    /*
+     * Block sizes are multiples of ALIGNMENT and the first block starts sizeof(Block) before
+     * an aligned address, so user data of every block is aligned. The word before the first block
+     * is zero, so it is never taken for the end size of a free left neighbour.
+     */
+    static const size_t FIRST_BLOCK_OFFSET = (sizeof(MemPage) + sizeof(size_t) + sizeof(Block) + ALIGNMENT - 1)
+                                             / ALIGNMENT * ALIGNMENT - sizeof(Block);
+    static const size_t DATA_SIZE = PAGE_SIZE - FIRST_BLOCK_OFFSET - sizeof(size_t);
+    static const size_t MIN_SIZE = (sizeof(FreeBlock) + sizeof(size_t) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+public:
+    static const size_t DEFAULT_RETAINED_EMPTY_PAGES = 1;
+
+private:
+    MemPage *mem = nullptr;
+    FreeLists freeLists;
+    PageMap *pageMap = nullptr;
+    int numaNode = -1; // node new pages are bound to, -1 leaves placement to the OS
+    size_t emptyPages = 0; // decommitted empty pages
+    size_t maxRetainedEmptyPages = DEFAULT_RETAINED_EMPTY_PAGES;
+    AllocatorStats counters;
 
 private:
+    static inline FreeBlock *firstBlock(MemPage *page) {
+        return reinterpret_cast<FreeBlock *>(toByte(page) + FIRST_BLOCK_OFFSET);
+    }
+
     inline FreeBlock *firstBlock() {
-        return reinterpret_cast<FreeBlock *>(mem + 1);
+        return firstBlock(mem);
+    }
+
+    static inline MemPage *pageOf(void *p) {
+        return reinterpret_cast<MemPage *>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t) (PAGE_SIZE - 1));
+    }
+
+    // page data except the header and the footer of its only free block, the rest may be decommitted
+    static inline byte *interiorBegin(MemPage *page) {
+        return toByte(firstBlock(page)) + sizeof(FreeBlock);
+    }
+
+    static inline size_t interiorSize() {
+        return DATA_SIZE - sizeof(FreeBlock) - sizeof(size_t);
     }
 
     inline void newPage() {
         MemPage *oldPage = mem;
-        mem = allocPage<MemPage>(PAGE_SIZE);
+        mem = allocAlignedPage<MemPage>(PAGE_SIZE, PAGE_SIZE);
+        if (numaNode >= 0) bindToNumaNode(mem, PAGE_SIZE, numaNode);
+        mem->prevPage = nullptr;
         mem->nextPage = oldPage;
-        mem->freeBlockEndSize = 0;
+        if (oldPage) oldPage->prevPage = mem;
+        if (pageMap) pageMap->insert(mem, PAGE_SIZE, this);
+        counters.pages++;
+        mem->decommitted = 0;
+        *(reinterpret_cast<size_t *>(firstBlock()) - 1) = 0;
         *reinterpret_cast<size_t *>(toByte(mem) + PAGE_SIZE - sizeof(size_t)) = -1;
-        freeBlocksHead = firstBlock();
-        freeBlocksHead->flaggedSize = DATA_SIZE;
-        freeBlocksHead->next = nullptr;
-        freeBlocksHead->prev = nullptr;
+        FreeBlock *block = firstBlock();
+        block->flaggedSize = DATA_SIZE;
 #ifdef DEBUG
-        freeBlocksHead->value = 0x5afe;
+        block->value = 0x5afe;
 #endif
+        freeLists.insert(block);
     }
 
-    FreeBlock *findFreeBlock(size_t size) {
-        for (FreeBlock *block = freeBlocksHead; block != nullptr; block = block->next) {
-            if (getValue(block->flaggedSize) >= size) {
-                return block;
-            }
+    // page is not the newest one and its only block is free
+    void onEmptyPage(MemPage *page, FreeBlock *block) {
+        if (emptyPages < maxRetainedEmptyPages) {
+            decommitPage(interiorBegin(page), interiorSize());
+            page->decommitted = 1;
+            emptyPages++;
+            return;
         }
-        return nullptr;
+        freeLists.remove(block);
+        if (page->prevPage) page->prevPage->nextPage = page->nextPage;
+        if (page->nextPage) page->nextPage->prevPage = page->prevPage;
+        if (pageMap) pageMap->erase(page, PAGE_SIZE);
+        freeAlignedPage(page, PAGE_SIZE);
+        counters.pages--;
     }
 
 public:
@@ -169,6 +276,22 @@ public:
         }
     }
 
+    // registers every page of this allocator in the map, must be set before init
+    void setPageMap(PageMap *map) {
+        assert(mem == nullptr);
+        pageMap = map;
+    }
+
+    // binds pages mapped afterwards to node, before they are touched
+    void setNumaNode(size_t node) {
+        numaNode = (int) node;
+    }
+
+    // empty pages over this count are returned to the OS, retained ones are decommitted
+    void setMaxRetainedEmptyPages(size_t count) {
+        maxRetainedEmptyPages = count;
+    }
+
     void init() override {
         assert(mem == nullptr);
         newPage();
@@ -177,10 +300,6 @@ public:
 
     void destroy() override final {
         assert(mem != nullptr);
-#ifdef DEBUG
-        blocksCount = 0;
-        consumed_memory = 0;
-#endif
         MemPage *tmp;
         do {
 #ifdef DEBUG
@@ -188,30 +307,42 @@ public:
             assert(firstBlock()->flaggedSize == DATA_SIZE);
 #endif
             tmp = mem->nextPage;
-            freePage(mem, PAGE_SIZE);
+            if (pageMap) pageMap->erase(mem, PAGE_SIZE);
+            freeAlignedPage(mem, PAGE_SIZE);
             mem = tmp;
         } while (mem != nullptr);
+        freeLists.clear();
+        emptyPages = 0;
+        counters = AllocatorStats();
     }
 
 
     void *alloc(size_t size) override {
         assert(mem != nullptr);
-        size += sizeof(Block);
+        size = alignUp(size + sizeof(Block));
         if (size < MIN_SIZE) {
             size = MIN_SIZE;
         }
         assert(size <= DATA_SIZE);
-#ifdef DEBUG
-        blocksCount++;
-        consumed_memory += size;
-#endif
-        FreeBlock *freeBlock = findFreeBlock(size);
+        FreeBlock *freeBlock = freeLists.find(size);
         if (freeBlock == nullptr) {
             newPage();
-            freeBlock = freeBlocksHead;
+            freeBlock = firstBlock();
+            counters.slowPathHits++;
+        }
+        MemPage *page = pageOf(freeBlock);
+        if (page->decommitted) {
+            commitPage(interiorBegin(page), interiorSize());
+            page->decommitted = 0;
+            emptyPages--;
+            counters.slowPathHits++;
         }
 
-        return freeBlock->takeBlock(size, &freeBlocksHead)->userData();
+        Block *block = freeBlock->takeBlock(size, &freeLists);
+        counters.allocs++;
+        counters.bytesLive += getValue(block->flaggedSize);
+        counters.peakBytesLive = std::max(counters.peakBytesLive, counters.bytesLive);
+        return block->userData();
     }
 
 
@@ -221,48 +352,57 @@ public:
         assert(isInAllocRange(p));
 #endif
         Block *block = reinterpret_cast<Block *>(toByte(p) - sizeof(size_t));
-#ifdef DEBUG
-        blocksCount--;
-        consumed_memory -= getValue(block->flaggedSize);
+#ifdef HARDENED
+        // a freed header loses IS_CONSUMED, also when the block is merged into its left neighbour
+        if (!hasFlag(block->flaggedSize, IS_CONSUMED) || (reinterpret_cast<uintptr_t>(p) & (ALIGNMENT - 1))) {
+            hardenedFailure("double free or free of a pointer which is not a block");
+        }
 #endif
+        counters.frees++;
+        counters.bytesLive -= getValue(block->flaggedSize);
         assert(hasFlag(block->flaggedSize, IS_CONSUMED));
         FreeBlock *freeBlock = reinterpret_cast<FreeBlock *>(block);
         freeBlock->setSize(getValue(block->flaggedSize), getFlag(block->flaggedSize, LEFT_CONSUMED));
-        freeBlock->prev = nullptr;
-        freeBlocksHead->prev = freeBlock;
-        freeBlock->next = freeBlocksHead;
 #ifdef DEBUG
         freeBlock->value = 0x5afe;
 #endif
 
-        freeBlocksHead = freeBlock;
         FreeBlock *left = freeBlock->leftBlock();
         if (left != nullptr) {
-            freeBlock = left->joinRight(&freeBlocksHead);
+            freeLists.remove(left);
+            left->setSize(getValue(left->flaggedSize) + getValue(freeBlock->flaggedSize),
+                          getFlag(left->flaggedSize, LEFT_CONSUMED));
+            freeBlock = left;
         }
-        freeBlock->joinRight(&freeBlocksHead);
+        freeBlock->joinRight(&freeLists);
+        freeLists.insert(freeBlock);
+
 
         size_t *right_size = freeBlock->shiftRight(getValue(freeBlock->flaggedSize));
         if (*right_size != 0) {
             *right_size &= ~LEFT_CONSUMED;
         }
+
+        MemPage *page = pageOf(freeBlock);
+        if (getValue(freeBlock->flaggedSize) == DATA_SIZE && page != mem) {
+            // the newest page is kept, so alloc/free of one block does not hit the OS every time
+            onEmptyPage(page, freeBlock);
+        }
     }
 
 #ifdef DEBUG
 
     void dumpStat() const override {
         int freeCount = 0;
-        for (FreeBlock *block = freeBlocksHead; block != nullptr; block = block->next) {
-            freeCount++;
+        for (size_t i = 0; i < FreeLists::BINS; i++) {
+            for (FreeBlock *block = freeLists.heads[i]; block != nullptr; block = block->next) {
+                freeCount++;
+            }
         }
-        std::cout << "Consumed blocks: " << blocksCount << "; Free blocks: " << freeCount << std::endl;
+        std::cout << "Consumed blocks: " << counters.allocs - counters.frees << "; Free blocks: " << freeCount << std::endl;
 
-        int pageCount = 0;
-        for (MemPage *page = mem; page != nullptr; page = page->nextPage) {
-            pageCount++;
-        }
-        std::cout << "Memory consumed: " << consumed_memory << " / " << pageCount * DATA_SIZE << std::endl;
-        std::cout << "Consumed OS blocks: " << pageCount << std::endl;
+        std::cout << "Memory consumed: " << counters.bytesLive << " / " << counters.pages * DATA_SIZE << std::endl;
+        std::cout << "Consumed OS blocks: " << counters.pages << std::endl;
         for (MemPage *page = mem; page != nullptr; page = page->nextPage) {
             std::cout << "page " << (void *) page << ' ' << PAGE_SIZE << std::endl;
         }
@@ -270,8 +410,8 @@ public:
 
     void dumpBlock() const override {
         for (MemPage *page = mem; page != nullptr; page = page->nextPage) {
-            FreeBlock *block = reinterpret_cast<FreeBlock *>(page + 1);
-            while (toByte(block) < toByte(page + 1) + DATA_SIZE) {
+            FreeBlock *block = firstBlock(page);
+            while (toByte(block) < toByte(firstBlock(page)) + DATA_SIZE) {
                 if (hasFlag(block->flaggedSize, IS_CONSUMED)) {
                     std::cout << (void *) block << ' ' << getValue(block->flaggedSize) << std::endl;
                 }
@@ -282,6 +422,106 @@ public:
 
 #endif
 
+    size_t usableSize(void *p) const override {
+        Block *block = reinterpret_cast<Block *>(toByte(p) - sizeof(Block));
+        return getValue(block->flaggedSize) - sizeof(Block);
+    }
+
+    /*
+     * Shrinking splits the tail off as a free block, growing takes the needed part of the free right neighbour
+     */
+    bool tryExpandInPlace(void *p, size_t size) override {
+        Block *block = reinterpret_cast<Block *>(toByte(p) - sizeof(Block));
+        size_t need = alignUp(size + sizeof(Block));
+        if (need < MIN_SIZE) need = MIN_SIZE;
+        size_t currentSize = getValue(block->flaggedSize);
+        size_t flags = getFlag(block->flaggedSize, ALL_FLAGS);
+        if (need <= currentSize) {
+            if (currentSize - need >= MIN_SIZE) {
+                block->flaggedSize = need | flags;
+                Block *tail = reinterpret_cast<Block *>(toByte(block) + need);
+                tail->flaggedSize = (currentSize - need) | LEFT_CONSUMED | IS_CONSUMED;
+                // the tail is released as if it was a block of its own, which is not a user free
+                counters.bytesLive += getValue(tail->flaggedSize);
+                free(tail->userData());
+                counters.frees--;
+            }
+            return true;
+        }
+        FreeBlock *right = reinterpret_cast<FreeBlock *>(block)->rightBlock();
+        if (right == nullptr || currentSize + getValue(right->flaggedSize) < need) {
+            return false;
+        }
+        freeLists.remove(right);
+        size_t joinedSize = currentSize + getValue(right->flaggedSize);
+        if (joinedSize - need >= MIN_SIZE) {
+            FreeBlock *rest = reinterpret_cast<FreeBlock *>(toByte(block) + need);
+            rest->setSize(joinedSize - need, LEFT_CONSUMED);
+#ifdef DEBUG
+            rest->value = 0x5afe;
+#endif
+            freeLists.insert(rest);
+        } else {
+            need = joinedSize;
+            size_t *right_size = reinterpret_cast<FreeBlock *>(block)->shiftRight(joinedSize);
+            if (*right_size != 0) {
+                *right_size |= LEFT_CONSUMED;
+            }
+        }
+        counters.bytesLive += need - currentSize;
+        counters.peakBytesLive = std::max(counters.peakBytesLive, counters.bytesLive);
+        block->flaggedSize = need | flags;
+        return true;
+    }
+
+    /*
+     * Alignments above ALIGNMENT take a block larger by the alignment, the part before the aligned
+     * address is split off and freed, the tail is trimmed by tryExpandInPlace
+     */
+    void *allocAligned(size_t size, size_t alignment) override {
+        assert(alignment && !(alignment & (alignment - 1)));
+        if (alignment <= ALIGNMENT) {
+            return alloc(size);
+        }
+        assert(size <= maxAlignedAllocSize(alignment));
+        byte *p = toByte(alloc(size + alignment + MIN_SIZE));
+        uintptr_t address = reinterpret_cast<uintptr_t>(p);
+        byte *aligned = p + (((address + alignment - 1) & ~(uintptr_t) (alignment - 1)) - address);
+        if (aligned != p && (size_t) (aligned - p) < MIN_SIZE) {
+            aligned += alignment; // the leading part must be large enough to be a free block
+        }
+        if (aligned != p) {
+            Block *lead = reinterpret_cast<Block *>(p - sizeof(Block));
+            Block *block = reinterpret_cast<Block *>(aligned - sizeof(Block));
+            size_t leadSize = aligned - p;
+            block->flaggedSize = (getValue(lead->flaggedSize) - leadSize) | LEFT_CONSUMED | IS_CONSUMED;
+            lead->flaggedSize = leadSize | getFlag(lead->flaggedSize, ALL_FLAGS);
+            // the leading part is released as if it was a block of its own, which is not a user free
+            free(p);
+            counters.frees--;
+        }
+        tryExpandInPlace(aligned, size);
+        return aligned;
+    }
+
+    // largest size allocAligned serves with the alignment
+    size_t maxAlignedAllocSize(size_t alignment) const {
+        if (alignment <= ALIGNMENT) {
+            return maxAllocSize();
+        }
+        return alignment + MIN_SIZE < maxAllocSize() ? maxAllocSize() - alignment - MIN_SIZE : 0;
+    }
+
+    size_t pagesCount() const {
+        return counters.pages;
+    }
+
+    AllocatorStats stats() const override {
+        AllocatorStats snapshot = counters;
+        snapshot.bytesMapped = counters.pages * PAGE_SIZE;
+        return snapshot;
+    }
+
     bool isInAllocRange(void *p) const override {
         for (MemPage *page = mem; page != nullptr; page = page->nextPage) {
             if (toByte(page) < toByte(p) && toByte(p) < toByte(page) + PAGE_SIZE) {
@@ -0,0 +1,268 @@
+//
+// Created by ko on 26.12.2020.
+//
+
+#ifndef ALLOCATOR_CONCURRENTFIXEDSIZEALLOCATOR_H
+#define ALLOCATOR_CONCURRENTFIXEDSIZEALLOCATOR_H
+
+#include "AbstractAllocator.h"
+#include "NativePageAllocator.h"
+#include "AllocatorStats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+#ifdef DEBUG
+#include <iostream>
+#endif
+
+/*
+ * Fixed size allocator which alloc and free may be called from any thread without locks.
+ * Free blocks form one Treiber stack, its head keeps a 16 bit tag next to a 48 bit pointer
+ * and every change of the head bumps the tag, so a pop which read an outdated head fails its CAS
+ * instead of installing a stale next pointer (ABA). Pages are never unmapped before destroy,
+ * so reading next of a block popped by another thread meanwhile is always safe.
+ * New blocks are bumped from the current page by fetch_add, an exhausted page is replaced by CAS.
+ */
+class ConcurrentFixedSizeAllocator : public AbstractAllocator {
+private:
+    // next is atomic because a pop may read it while the block is pushed back by another thread
+    struct Block {
+        std::atomic<Block *> next;
+    };
+
+    struct MemPage {
+        MemPage *nextPage;
+        std::atomic<size_t> bumped; // blocks taken from the never used part of the page, may run past allBlocks
+    };
+
+    // counters are split between threads, so counting does not make every core write one cache line
+    struct alignas(64) CounterStripe {
+        std::atomic<size_t> allocs{0};
+        std::atomic<size_t> frees{0};
+    };
+
+    static const size_t PAGE_SIZE = 1 << 23;
+    static const size_t CACHE_LINE = 64;
+    static const size_t DATA_OFFSET = (sizeof(MemPage) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    static const size_t DATA_SIZE = PAGE_SIZE - DATA_OFFSET;
+    static const size_t STRIPES = 16;
+
+    static const size_t POINTER_BITS = 48;
+    static const uint64_t POINTER_MASK = ((uint64_t) 1 << POINTER_BITS) - 1;
+
+    const size_t blockSize;
+    const size_t allBlocks;
+    std::atomic<uint64_t> freeHead{0}; // tagged pointer to the top of the free stack
+    std::atomic<MemPage *> current{nullptr};
+    std::atomic<MemPage *> mem{nullptr}; // list of all pages, pages are only pushed to it
+    std::atomic<size_t> pages{0};
+    std::atomic<size_t> slowPathHits{0};
+    CounterStripe stripes[STRIPES];
+
+private:
+    static inline Block *pointerOf(uint64_t tagged) {
+        return reinterpret_cast<Block *>(tagged & POINTER_MASK);
+    }
+
+    static inline uint64_t retag(uint64_t old, Block *block) {
+        uint64_t address = reinterpret_cast<uintptr_t>(block);
+        assert((address & ~POINTER_MASK) == 0);
+        return ((old >> POINTER_BITS) + 1) << POINTER_BITS | address;
+    }
+
+    inline Block *getBlock(size_t i, MemPage *page) const {
+        return reinterpret_cast<Block *>(toByte(page) + DATA_OFFSET + i * blockSize);
+    }
+
+    static inline CounterStripe &stripe(CounterStripe *stripes) {
+        static thread_local size_t index = std::hash<std::thread::id>()(std::this_thread::get_id()) % STRIPES;
+        return stripes[index];
+    }
+
+    inline Block *popFree() {
+        uint64_t head = freeHead.load(std::memory_order_acquire);
+        while (pointerOf(head) != nullptr) {
+            Block *next = pointerOf(head)->next.load(std::memory_order_relaxed);
+            if (freeHead.compare_exchange_weak(head, retag(head, next), std::memory_order_acquire,
+                                               std::memory_order_acquire)) {
+                return pointerOf(head);
+            }
+        }
+        return nullptr;
+    }
+
+    inline void pushFree(Block *block) {
+        uint64_t head = freeHead.load(std::memory_order_relaxed);
+        do {
+            block->next.store(pointerOf(head), std::memory_order_relaxed);
+        } while (!freeHead.compare_exchange_weak(head, retag(head, block), std::memory_order_release,
+                                                 std::memory_order_relaxed));
+    }
+
+    MemPage *newPage() {
+        MemPage *page = allocAlignedPage<MemPage>(PAGE_SIZE, PAGE_SIZE);
+        page->bumped.store(0, std::memory_order_relaxed);
+        return page;
+    }
+
+    void publishPage(MemPage *page) {
+        MemPage *head = mem.load(std::memory_order_relaxed);
+        do {
+            page->nextPage = head;
+        } while (!mem.compare_exchange_weak(head, page, std::memory_order_release, std::memory_order_relaxed));
+        pages.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // current page is exhausted, the thread which wins the CAS installs its new page, the others drop theirs
+    Block *allocSlow(MemPage *exhausted) {
+        slowPathHits.fetch_add(1, std::memory_order_relaxed);
+        Block *block = popFree();
+        if (block != nullptr) {
+            return block;
+        }
+        if (current.load(std::memory_order_acquire) != exhausted) {
+            return nullptr; // another thread has already replaced the page
+        }
+        MemPage *page = newPage();
+        page->bumped.store(1, std::memory_order_relaxed); // its first block is for this thread
+        if (current.compare_exchange_strong(exhausted, page, std::memory_order_acq_rel)) {
+            publishPage(page);
+            return getBlock(0, page);
+        }
+        freeAlignedPage(page, PAGE_SIZE);
+        return nullptr;
+    }
+
+public:
+    explicit ConcurrentFixedSizeAllocator(size_t blockSize) : blockSize(blockSize), allBlocks(DATA_SIZE / blockSize) {
+        assert(blockSize >= sizeof(Block));
+        assert(blockSize % sizeof(void *) == 0);
+    }
+
+    ~ConcurrentFixedSizeAllocator() {
+        assert(mem.load() == nullptr);
+        if (mem.load() != nullptr) {
+            destroy();
+        }
+    }
+
+    // not thread safe as any init
+    void init() override {
+        assert(mem.load() == nullptr);
+        MemPage *page = newPage();
+        publishPage(page);
+        current.store(page, std::memory_order_release);
+    }
+
+    // not thread safe as any destroy
+    void destroy() override final {
+        assert(mem.load() != nullptr);
+        MemPage *page = mem.load();
+        while (page != nullptr) {
+            MemPage *next = page->nextPage;
+            freeAlignedPage(page, PAGE_SIZE);
+            page = next;
+        }
+        mem.store(nullptr);
+        current.store(nullptr);
+        freeHead.store(0);
+        pages.store(0);
+        slowPathHits.store(0);
+        for (CounterStripe &s : stripes) {
+            s.allocs.store(0);
+            s.frees.store(0);
+        }
+    }
+
+    void *alloc(size_t size) override {
+        assert(size <= blockSize);
+        CounterStripe &counters = stripe(stripes);
+        counters.allocs.fetch_add(1, std::memory_order_relaxed);
+        Block *block = popFree();
+        while (block == nullptr) {
+            MemPage *page = current.load(std::memory_order_acquire);
+            size_t i = page->bumped.fetch_add(1, std::memory_order_relaxed);
+            block = i < allBlocks ? getBlock(i, page) : allocSlow(page);
+        }
+        return block;
+    }
+
+    // every block is aligned to the highest power of two dividing both the block size and the data offset
+    size_t blockAlignment() const {
+        return std::min((size_t) 1 << lowestBit(blockSize), (size_t) 1 << lowestBit(DATA_OFFSET));
+    }
+
+    void *allocAligned(size_t size, size_t alignment) override {
+        assert(alignment <= blockAlignment());
+        return alloc(size);
+    }
+
+    void free(void *p) override {
+#ifdef DEBUG
+        assert(isInAllocRange(p));
+#endif
+        stripe(stripes).frees.fetch_add(1, std::memory_order_relaxed);
+        pushFree(reinterpret_cast<Block *>(p));
+    }
+
+    size_t usableSize(void *p) const override {
+        return blockSize;
+    }
+
+    size_t pagesCount() const {
+        return pages.load(std::memory_order_relaxed);
+    }
+
+    AllocatorStats stats() const override {
+        AllocatorStats snapshot;
+        for (const CounterStripe &s : stripes) {
+            snapshot.allocs += s.allocs.load(std::memory_order_relaxed);
+            snapshot.frees += s.frees.load(std::memory_order_relaxed);
+        }
+        // frees of a stripe may be seen ahead of allocs of another one
+        snapshot.bytesLive = snapshot.allocs > snapshot.frees ? (snapshot.allocs - snapshot.frees) * blockSize : 0;
+        snapshot.peakBytesLive = snapshot.bytesLive; // the peak is not tracked, it would need a shared counter
+        snapshot.pages = pagesCount();
+        snapshot.bytesMapped = snapshot.pages * PAGE_SIZE;
+        snapshot.slowPathHits = slowPathHits.load(std::memory_order_relaxed);
+        return snapshot;
+    }
+
+#ifdef DEBUG
+
+    void dumpStat() const override {
+        AllocatorStats snapshot = stats();
+        std::cout << "Consumed blocks: " << snapshot.allocs - snapshot.frees << std::endl;
+        std::cout << "Memory consumed: " << snapshot.bytesLive << " / " << snapshot.bytesMapped << std::endl;
+        std::cout << "Consumed OS blocks: " << snapshot.pages << std::endl;
+    }
+
+    void dumpBlock() const override {
+        for (MemPage *page = mem.load(); page != nullptr; page = page->nextPage) {
+            std::cout << "page " << (void *) page << ' ' << PAGE_SIZE << ' '
+                      << std::min(page->bumped.load(), allBlocks) << std::endl;
+        }
+    }
+
+#endif
+
+    bool isInAllocRange(void *p) const override {
+        for (MemPage *page = mem.load(std::memory_order_acquire); page != nullptr; page = page->nextPage) {
+            if (toByte(page) < toByte(p) && toByte(p) < toByte(page) + PAGE_SIZE) {
+                return (toByte(p) - toByte(page) - DATA_OFFSET) % blockSize == 0;
+            }
+        }
+        return false;
+    }
+
+    size_t maxAllocSize() const override {
+        return blockSize;
+    }
+};
+
+#endif //ALLOCATOR_CONCURRENTFIXEDSIZEALLOCATOR_H
@@ -3,12 +3,17 @@
 
 #include "AbstractAllocator.h"
 #include "NativePageAllocator.h"
+#include "Numa.h"
+#include "PageMap.h"
+#include "AllocatorStats.h"
+#include "Hardening.h"
 
-#ifdef WINDOWS
-#include <algorithm> // std::min for windows
-#endif
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 
 #ifdef DEBUG
+#include <iostream>
 #include <set>
 #endif
 
@@ -21,50 +26,287 @@ private:
         Block *next;
     };
 
+    /*
+     * Every page keeps its own free list and count of live blocks, so a page which becomes empty
+     * can be reset or returned to the OS without touching blocks of other pages
+     */
     struct MemPage {
+        MemPage *prevPage;
         MemPage *nextPage;
+        MemPage *prevAvailable; // links of the list of not current pages having free blocks
+        MemPage *nextAvailable;
+        Block *freeBlocksHead;
+        size_t initializedBlocks;
+        size_t liveBlocks;
+        size_t committedSize; // prefix of the page backed by memory
+        size_t isAvailable;
     };
 
-    static const size_t DATA_SIZE = 1 << 23;
-    static const size_t PAGE_SIZE = DATA_SIZE + sizeof(MemPage);
+    static const size_t PAGE_SIZE = 1 << 23;
+    static const size_t CACHE_LINE = 64;
+#ifdef HARDENED
+    // bitmap of live blocks follows the page header, it has a bit for every block of the smallest size
+    static const size_t BITMAP_WORDS = PAGE_SIZE / sizeof(void *) / 64;
+    static const size_t BITMAP_SIZE = BITMAP_WORDS * sizeof(uint64_t);
+    // fresh blocks are threaded to the free list by runs of this length in a random order
+    static const size_t SHUFFLE_RUN = 16;
+#else
+    static const size_t BITMAP_SIZE = 0;
+#endif
+    // blocks start at a cache line boundary, so a block is aligned as much as its size allows
+    static const size_t DATA_OFFSET = (sizeof(MemPage) + BITMAP_SIZE + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    static const size_t DATA_SIZE = PAGE_SIZE - DATA_OFFSET;
+    static const size_t COMMIT_STEP = 1 << 20;
+
+public:
+    static const size_t DEFAULT_RETAINED_EMPTY_PAGES = 1;
 
 private:
     const size_t blockSize;
-    MemPage *mem = nullptr;
-    Block *freeBlocksHead = nullptr;
-    size_t initializedBlocks = 0;
+    const size_t allBlocks;
+    MemPage *mem = nullptr; // list of all pages
+    MemPage *current = nullptr; // page blocks are allocated from
+    // non empty available pages go to the head, empty ones to the tail, so empty pages stay empty
+    MemPage *availableHead = nullptr;
+    MemPage *availableTail = nullptr;
+    size_t emptyPages = 0; // empty pages retained in the available list
+    size_t maxRetainedEmptyPages = DEFAULT_RETAINED_EMPTY_PAGES;
+    PageMap *pageMap = nullptr;
+    int numaNode = -1; // node new pages are bound to, -1 leaves placement to the OS
+    AllocatorStats counters;
+#ifdef HARDENED
+    HardenedRandom random;
+    // block index is offset * reciprocal >> RECIPROCAL_SHIFT, exact for offsets inside a page and blocks below 2^17
+    static const size_t RECIPROCAL_SHIFT = 40;
+    const uint64_t reciprocal;
+#endif
 
 private:
-    inline Block *getBlock(int i, MemPage *page) const {
-        return reinterpret_cast<Block *>(toByte(page + 1) + i * blockSize);
+    inline Block *getBlock(size_t i, MemPage *page) const {
+        return reinterpret_cast<Block *>(toByte(page) + DATA_OFFSET + i * blockSize);
+    }
+
+    static inline MemPage *pageOf(void *p) {
+        return reinterpret_cast<MemPage *>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t) (PAGE_SIZE - 1));
+    }
+
+#ifdef HARDENED
+
+    // fails on pointers which are not a block start, so a wild free does not touch the bitmap of another block.
+    // Words are written by the owner of the allocator only, atomic so checkLive may read them meanwhile
+    inline std::atomic<uint64_t> &liveWord(void *p, uint64_t &bit) const {
+        MemPage *page = pageOf(p);
+        // a pointer into the header wraps the offset around, no block index times the size gives it back
+        size_t offset = toByte(p) - toByte(page) - DATA_OFFSET;
+        size_t i = (size_t) ((offset * reciprocal) >> RECIPROCAL_SHIFT);
+        if (i >= allBlocks || i * blockSize != offset) {
+            hardenedFailure("free of a pointer which is not a block");
+        }
+        bit = (uint64_t) 1 << (i % 64);
+        return reinterpret_cast<std::atomic<uint64_t> *>(toByte(page) + sizeof(MemPage))[i / 64];
+    }
+
+    // block p leaves the allocator, it must not be live already, otherwise the free list is corrupted
+    inline void markLive(void *p) {
+        uint64_t bit;
+        std::atomic<uint64_t> &word = liveWord(p, bit);
+        uint64_t live = word.load(std::memory_order_relaxed);
+        if (live & bit) {
+            hardenedFailure("block is allocated twice, free list is corrupted");
+        }
+        word.store(live | bit, std::memory_order_relaxed);
+    }
+
+    // block p comes back, it must be live
+    inline void markFree(void *p) {
+        uint64_t bit;
+        std::atomic<uint64_t> &word = liveWord(p, bit);
+        uint64_t live = word.load(std::memory_order_relaxed);
+        if (!(live & bit)) {
+            hardenedFailure("double free or free of a block which was never allocated");
+        }
+        word.store(live & ~bit, std::memory_order_relaxed);
     }
 
-    inline Block *getBlock(int i) const {
-        return getBlock(i, mem);
+    // puts fresh blocks of the page to its free list in a random order
+    void shuffleFreshBlocks(MemPage *page) {
+        size_t run = allBlocks - page->initializedBlocks;
+        if (run > SHUFFLE_RUN) run = SHUFFLE_RUN;
+        Block *fresh[SHUFFLE_RUN];
+        for (size_t i = 0; i < run; i++) {
+            fresh[i] = getBlock(page->initializedBlocks + i, page);
+        }
+        commitUpTo(page, toByte(fresh[run - 1]) + blockSize);
+        page->initializedBlocks += run;
+        random.shuffle(fresh, run);
+        for (size_t i = 0; i < run; i++) {
+#ifdef DEBUG
+            fresh[i]->value = 0x5afe;
+#endif
+            fresh[i]->next = page->freeBlocksHead;
+            page->freeBlocksHead = fresh[i];
+        }
     }
 
-    inline Block *firstBlock() const {
-        return reinterpret_cast<Block *>(mem + 1);
+    // freed block goes to the head of the free list or right after it, so reuse order is not predictable
+    inline void pushFree(MemPage *page, Block *block) {
+        Block *head = page->freeBlocksHead;
+        // the choice is made without a branch, a random branch would be mispredicted on every second free
+        Block **link = head != nullptr && random.nextBit() ? &head->next : &page->freeBlocksHead;
+        block->next = *link;
+        *link = block;
     }
 
+#endif
+
     inline void newPage() {
-        MemPage *oldPage = mem;
-        mem = allocPage<MemPage>(PAGE_SIZE);
-        mem->nextPage = oldPage;
-        freeBlocksHead = firstBlock();
-        initializedBlocks = 0;
+        MemPage *page;
+        if (pageOptions().lazyCommit) {
+            page = reserveAlignedPage<MemPage>(PAGE_SIZE, PAGE_SIZE);
+            if (numaNode >= 0) bindToNumaNode(page, PAGE_SIZE, numaNode);
+            commitPage(page, COMMIT_STEP);
+            page->committedSize = COMMIT_STEP;
+        } else {
+            page = allocAlignedPage<MemPage>(PAGE_SIZE, PAGE_SIZE);
+            if (numaNode >= 0) bindToNumaNode(page, PAGE_SIZE, numaNode);
+            page->committedSize = PAGE_SIZE;
+        }
+        page->prevPage = nullptr;
+        page->nextPage = mem;
+        if (mem) mem->prevPage = page;
+        mem = page;
+        page->isAvailable = 0;
+        resetPage(page);
+        if (pageMap) pageMap->insert(page, PAGE_SIZE, this);
+        counters.pages++;
+        current = page;
+    }
+
+    // forgets the free list of an empty page, its blocks are threaded again on demand
+    inline void resetPage(MemPage *page) {
+        page->freeBlocksHead = nullptr;
+        page->initializedBlocks = 0;
+        page->liveBlocks = 0;
+    }
+
+    inline void pushAvailable(MemPage *page) {
+        page->isAvailable = 1;
+        page->prevAvailable = nullptr;
+        page->nextAvailable = availableHead;
+        if (availableHead) availableHead->prevAvailable = page;
+        else availableTail = page;
+        availableHead = page;
+    }
+
+    inline void pushAvailableTail(MemPage *page) {
+        page->isAvailable = 1;
+        page->nextAvailable = nullptr;
+        page->prevAvailable = availableTail;
+        if (availableTail) availableTail->nextAvailable = page;
+        else availableHead = page;
+        availableTail = page;
     }
 
-    inline Block *takeBlock() {
-        Block *block = freeBlocksHead;
-        freeBlocksHead = freeBlocksHead->next;
+    inline void removeAvailable(MemPage *page) {
+        page->isAvailable = 0;
+        if (page->prevAvailable) page->prevAvailable->nextAvailable = page->nextAvailable;
+        else availableHead = page->nextAvailable;
+        if (page->nextAvailable) page->nextAvailable->prevAvailable = page->prevAvailable;
+        else availableTail = page->prevAvailable;
+    }
+
+    inline void releasePage(MemPage *page) {
+        if (page->prevPage) page->prevPage->nextPage = page->nextPage;
+        else mem = page->nextPage;
+        if (page->nextPage) page->nextPage->prevPage = page->prevPage;
+        if (pageMap) pageMap->erase(page, PAGE_SIZE);
+        freeAlignedPage(page, PAGE_SIZE);
+        counters.pages--;
+    }
+
+    // not current page lost its last live block
+    void onEmptyPage(MemPage *page) {
+        if (page->isAvailable) removeAvailable(page);
+        if (emptyPages < maxRetainedEmptyPages) {
+            resetPage(page);
+            // the system page holding the header stays, the rest is committed again while threading
+            decommitPage(toByte(page) + DATA_OFFSET, DATA_SIZE);
+            page->committedSize = systemPageSize();
+            pushAvailableTail(page);
+            emptyPages++;
+        } else {
+            releasePage(page);
+        }
+    }
+
+    // steps start where the committed prefix ends, which is off their grid on a reset page, so the last one is clamped
+    inline void commitUpTo(MemPage *page, byte *limit) {
+        while (limit > toByte(page) + page->committedSize) {
+            size_t step = std::min(COMMIT_STEP, PAGE_SIZE - page->committedSize);
+            commitPage(toByte(page) + page->committedSize, step);
+            page->committedSize += step;
+        }
+    }
+
+    inline Block *takeBlock(MemPage *page) {
+        Block *block = page->freeBlocksHead;
+        if (block != nullptr) {
+            page->freeBlocksHead = block->next;
+        } else if (page->initializedBlocks < allBlocks) {
+#ifdef HARDENED
+            shuffleFreshBlocks(page);
+            block = page->freeBlocksHead;
+            page->freeBlocksHead = block->next;
+#else
+            block = getBlock(page->initializedBlocks++, page);
+            commitUpTo(page, toByte(block) + blockSize);
+#ifdef DEBUG
+            block->value = 0x5afe;
+#endif
+#endif
+        } else {
+            return nullptr;
+        }
+        page->liveBlocks++;
         return block;
     }
 
+    // page got free blocks back, it becomes available or empty unless it is the current one
+    inline void onBlocksFreed(MemPage *page) {
+        if (page == current) {
+            return;
+        }
+        if (page->liveBlocks == 0) {
+            onEmptyPage(page);
+        } else if (!page->isAvailable) {
+            pushAvailable(page);
+        }
+    }
+
+    // current page is exhausted, continue with an available page or a new one
+    void switchPage() {
+        counters.slowPathHits++;
+        if (availableHead != nullptr) {
+            MemPage *page = availableHead;
+            removeAvailable(page);
+            if (page->liveBlocks == 0) emptyPages--;
+            current = page;
+        } else {
+            newPage();
+        }
+    }
+
 public:
-    FixedSizeAllocator(size_t blockSize) : blockSize(blockSize) {
+    FixedSizeAllocator(size_t blockSize) : blockSize(blockSize), allBlocks(DATA_SIZE / blockSize)
+#ifdef HARDENED
+            , reciprocal(((uint64_t) 1 << RECIPROCAL_SHIFT) / blockSize + 1)
+#endif
+    {
         assert(blockSize >= sizeof(Block));
-        assert(blockSize && !(blockSize & (blockSize - 1))); // check power of two
+#ifdef HARDENED
+        assert(blockSize < ((size_t) 1 << 17));
+#endif
+        assert(blockSize % sizeof(void *) == 0); // keeps every block aligned as the page header
     }
 
     ~FixedSizeAllocator() {
@@ -74,6 +316,22 @@ public:
         }
     }
 
+    // registers every page of this allocator in the map, must be set before init
+    void setPageMap(PageMap *map) {
+        assert(mem == nullptr);
+        pageMap = map;
+    }
+
+    // binds pages mapped afterwards to node, before they are touched
+    void setNumaNode(size_t node) {
+        numaNode = (int) node;
+    }
+
+    // empty pages over this count are returned to the OS, retained ones are decommitted
+    void setMaxRetainedEmptyPages(size_t count) {
+        maxRetainedEmptyPages = count;
+    }
+
     void init() override {
         assert(mem == nullptr);
         newPage();
@@ -84,90 +342,217 @@ public:
         MemPage *tmp;
         do {
 #ifdef DEBUG
-            byte *end = toByte(getBlock(initializedBlocks));
-            for (Block *block = firstBlock(); toByte(block) < end; block = reinterpret_cast<Block *>(toByte(block) + blockSize)) {
-                assert(block->value == 0x5afe);
+            for (size_t i = 0; i < mem->initializedBlocks; i++) {
+                assert(getBlock(i, mem)->value == 0x5afe);
             }
-            initializedBlocks = DATA_SIZE / blockSize;
 #endif
             tmp = mem->nextPage;
-            freePage(mem, PAGE_SIZE);
+            if (pageMap) pageMap->erase(mem, PAGE_SIZE);
+            freeAlignedPage(mem, PAGE_SIZE);
             mem = tmp;
         } while (mem != nullptr);
+        current = availableHead = availableTail = nullptr;
+        emptyPages = 0;
+        counters = AllocatorStats();
     }
 
     void *alloc(size_t size) override {
         assert(mem != nullptr);
         assert(size <= blockSize);
-        if (freeBlocksHead == nullptr) {
-            newPage();
+        Block *block = takeBlock(current);
+        if (block == nullptr) {
+            switchPage();
+            block = takeBlock(current);
         }
-        size_t allBlocks = DATA_SIZE / blockSize;
-        if (initializedBlocks < allBlocks) {
-            Block *block = getBlock(initializedBlocks);
-            block->next = ++initializedBlocks < allBlocks ? getBlock(initializedBlocks) : nullptr;
-#ifdef DEBUG
-            block->value = 0x5afe;
-#endif
-        }
-
-        Block *block = takeBlock();
 #ifdef DEBUG
         assert(block->value == 0x5afe);
 #endif
+#ifdef HARDENED
+        markLive(block);
+#endif
+        counters.allocs++;
+        counters.bytesLive += blockSize;
+        counters.peakBytesLive = std::max(counters.peakBytesLive, counters.bytesLive);
         return block;
     }
 
     void free(void *p) override {
+#ifdef HARDENED
+        markFree(p);
+#endif
 #ifdef DEBUG
         assert(isInAllocRange(p));
 #endif
         assert(mem != nullptr);
         Block *block = reinterpret_cast<Block *>(p);
-        block->next = freeBlocksHead;
-        freeBlocksHead = block;
+        MemPage *page = pageOf(p);
+        assert(page->liveBlocks > 0);
+#ifdef HARDENED
+        pushFree(page, block);
+#else
+        block->next = page->freeBlocksHead;
+        page->freeBlocksHead = block;
+#endif
 #ifdef DEBUG
         block->value = 0x5afe;
 #endif
+        page->liveBlocks--;
+        counters.frees++;
+        counters.bytesLive -= blockSize;
+        onBlocksFreed(page);
     }
 
+    /*
+     * Fills out with n blocks. Free blocks of the current page go first, then a run of never used
+     * blocks is carved from the rest of the page at once.
+     * In the hardened mode blocks go through the live bitmap as with alloc, and the run of never used
+     * blocks is shuffled, so neighbours in memory are not handed out one after another.
+     */
+    void allocBulk(size_t n, void **out) {
+        assert(mem != nullptr);
+        size_t done = 0;
+        while (true) {
+            MemPage *page = current;
+            size_t taken = done;
+            while (done < n && page->freeBlocksHead != nullptr) {
+                Block *block = page->freeBlocksHead;
+                page->freeBlocksHead = block->next;
+#ifdef DEBUG
+                assert(block->value == 0x5afe);
+#endif
+                out[done++] = block;
+            }
+            size_t run = std::min(n - done, allBlocks - page->initializedBlocks);
+            if (run > 0) {
+                byte *first = toByte(getBlock(page->initializedBlocks, page));
+                commitUpTo(page, first + run * blockSize);
+                for (size_t i = 0; i < run; i++) {
+                    Block *block = reinterpret_cast<Block *>(first + i * blockSize);
 #ifdef DEBUG
+                    block->value = 0x5afe;
+#endif
+                    out[done++] = block;
+                }
+                page->initializedBlocks += run;
+#ifdef HARDENED
+                random.shuffle(out + done - run, run);
+#endif
+            }
+#ifdef HARDENED
+            for (size_t i = taken; i < done; i++) {
+                markLive(out[i]);
+            }
+#endif
+            page->liveBlocks += done - taken;
+            if (done == n) {
+                break;
+            }
+            switchPage();
+        }
+        counters.allocs += n;
+        counters.bytesLive += n * blockSize;
+        counters.peakBytesLive = std::max(counters.peakBytesLive, counters.bytesLive);
+    }
 
-    void dumpStat() const override {
-        int freeCount = 0;
-        for (Block *block = freeBlocksHead; block != nullptr; block = block->next) {
-            freeCount++;
+    // blocks of one page which follow each other in ptrs are spliced to its free list as one chain
+    void freeBulk(void **ptrs, size_t n) {
+        assert(mem != nullptr);
+        size_t i = 0;
+        while (i < n) {
+            MemPage *page = pageOf(ptrs[i]);
+            Block *head = page->freeBlocksHead;
+            size_t j = i;
+            for (; j < n && pageOf(ptrs[j]) == page; j++) {
+#ifdef HARDENED
+                markFree(ptrs[j]);
+#endif
+#ifdef DEBUG
+                assert(isInAllocRange(ptrs[j]));
+#endif
+                Block *block = reinterpret_cast<Block *>(ptrs[j]);
+                block->next = head;
+#ifdef DEBUG
+                block->value = 0x5afe;
+#endif
+                head = block;
+            }
+            assert(page->liveBlocks >= j - i);
+            page->freeBlocksHead = head;
+            page->liveBlocks -= j - i;
+            onBlocksFreed(page);
+            i = j;
+        }
+        counters.frees += n;
+        counters.bytesLive -= n * blockSize;
+    }
+
+#ifdef HARDENED
+
+    // fails unless p is a live block, it may be called while another thread holds the allocator
+    inline void checkLive(void *p) const {
+        uint64_t bit;
+        if (!(liveWord(p, bit).load(std::memory_order_relaxed) & bit)) {
+            hardenedFailure("double free or free of a block which was never allocated");
         }
-        int pageCount = 0, blocksCount = -freeCount;
+    }
+
+#endif
+
+    // every block is aligned to the highest power of two dividing both the block size and the data offset
+    size_t blockAlignment() const {
+        return std::min((size_t) 1 << lowestBit(blockSize), (size_t) 1 << lowestBit(DATA_OFFSET));
+    }
+
+    void *allocAligned(size_t size, size_t alignment) override {
+        assert(alignment <= blockAlignment());
+        return alloc(size);
+    }
+
+    size_t usableSize(void *p) const override {
+        return blockSize;
+    }
+
+    size_t pagesCount() const {
+        return counters.pages;
+    }
+
+    AllocatorStats stats() const override {
+        AllocatorStats snapshot = counters;
+        snapshot.bytesMapped = counters.pages * PAGE_SIZE;
+        return snapshot;
+    }
+
+#ifdef DEBUG
+
+    void dumpStat() const override {
+        size_t pageCount = 0, blocksCount = 0, freeCount = 0;
         for (MemPage *page = mem; page != nullptr; page = page->nextPage) {
             pageCount++;
-            blocksCount += page == mem ? std::min(initializedBlocks, DATA_SIZE / blockSize) : DATA_SIZE / blockSize;
+            blocksCount += page->liveBlocks;
+            freeCount += allBlocks - page->liveBlocks;
         }
         std::cout << "Consumed blocks: " << blocksCount << "; Free blocks: " << freeCount << std::endl;
 
         std::cout << "Memory consumed: " << blocksCount * blockSize << " / " << pageCount * DATA_SIZE << std::endl;
         std::cout << "Consumed OS blocks: " << pageCount << std::endl;
         for (MemPage *page = mem; page != nullptr; page = page->nextPage) {
-            std::cout << "page " << (void *) page << ' ' << PAGE_SIZE << std::endl;
+            std::cout << "page " << (void *) page << ' ' << PAGE_SIZE << ' ' << page->liveBlocks << std::endl;
         }
     }
 
     void dumpBlock() const override {
-        std::set<Block *> allBlocks;
         for (MemPage *page = mem; page != nullptr; page = page->nextPage) {
-            size_t size = page == mem ? std::min(initializedBlocks, DATA_SIZE / blockSize) : DATA_SIZE / blockSize;
-            for (int i = 0; i < size; i++) {
-                Block *block = getBlock(i, page);
-                allBlocks.insert(block);
+            std::set<Block *> allBlocks;
+            for (size_t i = 0; i < page->initializedBlocks; i++) {
+                allBlocks.insert(getBlock(i, page));
+            }
+            for (Block *block = page->freeBlocksHead; block != nullptr; block = block->next) {
+                allBlocks.erase(block);
+            }
+            for (Block *block : allBlocks) {
+                std::cout << (void *) block << ' ' << blockSize << std::endl;
             }
         }
-        for (Block *block = freeBlocksHead; block != nullptr; block = block->next) {
-            allBlocks.erase(block);
-        }
-        for (Block *block : allBlocks) {
-            std::cout << (void *) block << ' ' << blockSize << std::endl;
-        }
-
     }
 
 #endif
@@ -177,7 +562,7 @@ public:
         for (MemPage *page = mem; page != nullptr; page = page->nextPage) {
             bool inPage = toByte(page) < toByte(p) && toByte(p) < toByte(page) + PAGE_SIZE;
             if (inPage) {
-                bool correctPadding = (toByte(p) - toByte(page + 1)) % blockSize == 0;
+                bool correctPadding = (toByte(p) - toByte(page) - DATA_OFFSET) % blockSize == 0;
                 return  correctPadding;
             }
         }
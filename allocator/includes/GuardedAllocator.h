@@ -0,0 +1,186 @@
+//
+// Created by ko on 27.12.2020.
+//
+
+#ifndef ALLOCATOR_GUARDEDALLOCATOR_H
+#define ALLOCATOR_GUARDEDALLOCATOR_H
+
+#include "AbstractAllocator.h"
+#include "NativePageAllocator.h"
+#include "PageMap.h"
+#include "AllocatorStats.h"
+#include "Hardening.h"
+
+#include <cassert>
+#include <cstdint>
+
+#ifdef DEBUG
+#include <iostream>
+#endif
+
+/*
+ * Every block gets a system page of its own, placed right before an inaccessible guard page
+ * and ending at its border, so an overflow faults at once. A freed page becomes inaccessible too
+ * and slots are reused in FIFO order, so a use after free faults until the slot comes around again.
+ * Meant for a small sample of allocations: the number of slots is fixed, alloc returns nullptr
+ * when they are all taken.
+ */
+class GuardedAllocator : public AbstractAllocator {
+private:
+    struct Slot {
+        void *user; // nullptr while the slot is free
+        size_t size;
+    };
+
+    static const size_t REGION_SIZE = PageMap::REGION_SIZE;
+    static const size_t ALIGNMENT = 16;
+
+    byte *region = nullptr; // reserved address range, slot i takes its pages 2i and 2i + 1
+    Slot *slots = nullptr;
+    size_t *freeSlots = nullptr; // FIFO ring of free slot indices
+    size_t freeHead = 0;
+    size_t freeCount = 0;
+    size_t slotsCount = 0;
+    PageMap *pageMap = nullptr;
+    AllocatorStats counters;
+
+private:
+    static inline size_t pageSize() {
+        return systemPageSize();
+    }
+
+    inline byte *slotData(size_t i) const {
+        return region + 2 * i * pageSize();
+    }
+
+    inline size_t metadataSize() const {
+        return slotsCount * (sizeof(Slot) + sizeof(size_t));
+    }
+
+public:
+    ~GuardedAllocator() {
+        assert(region == nullptr);
+        if (region != nullptr) {
+            destroy();
+        }
+    }
+
+    // registers the region of this allocator in the map, must be set before init
+    void setPageMap(PageMap *map) {
+        assert(region == nullptr);
+        pageMap = map;
+    }
+
+    void init() override {
+        assert(region == nullptr);
+        region = reserveAlignedPage<byte>(REGION_SIZE, REGION_SIZE);
+        slotsCount = REGION_SIZE / (2 * pageSize());
+        byte *metadata = allocPage<byte>(metadataSize());
+        slots = reinterpret_cast<Slot *>(metadata);
+        freeSlots = reinterpret_cast<size_t *>(metadata + slotsCount * sizeof(Slot));
+        for (size_t i = 0; i < slotsCount; i++) {
+            slots[i].user = nullptr;
+            freeSlots[i] = i;
+        }
+        freeHead = 0;
+        freeCount = slotsCount;
+        if (pageMap) pageMap->insert(region, REGION_SIZE, this);
+    }
+
+    void destroy() override final {
+        assert(region != nullptr);
+        if (pageMap) pageMap->erase(region, REGION_SIZE);
+        freeAlignedPage(region, REGION_SIZE);
+        freePage(slots, metadataSize());
+        region = nullptr;
+        slots = nullptr;
+        freeSlots = nullptr;
+        counters = AllocatorStats();
+    }
+
+    // nullptr if every slot is taken
+    void *alloc(size_t size) override {
+        assert(region != nullptr);
+        assert(size <= maxAllocSize());
+        if (freeCount == 0) {
+            return nullptr;
+        }
+        size_t i = freeSlots[freeHead];
+        freeHead = (freeHead + 1) % slotsCount;
+        freeCount--;
+        size = size == 0 ? ALIGNMENT : (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        byte *data = slotData(i);
+        commitPage(data, pageSize());
+        slots[i].user = data + pageSize() - size;
+        slots[i].size = size;
+        counters.allocs++;
+        counters.pages++;
+        counters.bytesLive += size;
+        counters.peakBytesLive = std::max(counters.peakBytesLive, counters.bytesLive);
+        return slots[i].user;
+    }
+
+    // blocks end at the guard page, so only alignments which divide the size are served
+    void *allocAligned(size_t size, size_t alignment) override {
+        assert(alignment && !(alignment & (alignment - 1)));
+        assert(alignment <= ALIGNMENT);
+        return alloc(size);
+    }
+
+    void free(void *p) override {
+        if (toByte(p) < region || toByte(p) >= region + REGION_SIZE) {
+            hardenedFailure("free of a pointer outside of the guarded region");
+        }
+        size_t i = (toByte(p) - region) / (2 * pageSize());
+        if (slots[i].user != p) {
+            hardenedFailure("double free or invalid free of a guarded block");
+        }
+        guardPage(slotData(i), pageSize());
+        slots[i].user = nullptr;
+        freeSlots[(freeHead + freeCount) % slotsCount] = i;
+        freeCount++;
+        counters.frees++;
+        counters.pages--;
+        counters.bytesLive -= slots[i].size;
+    }
+
+    size_t usableSize(void *p) const override {
+        return slots[(toByte(p) - region) / (2 * pageSize())].size;
+    }
+
+    AllocatorStats stats() const override {
+        AllocatorStats snapshot = counters;
+        snapshot.bytesMapped = counters.pages * pageSize();
+        return snapshot;
+    }
+
+#ifdef DEBUG
+
+    void dumpStat() const override {
+        std::cout << "Guarded blocks: " << slotsCount - freeCount << " / " << slotsCount << std::endl;
+        std::cout << "Memory consumed: " << counters.bytesLive << " / " << counters.pages * pageSize() << std::endl;
+    }
+
+    void dumpBlock() const override {
+        for (size_t i = 0; i < slotsCount; i++) {
+            if (slots[i].user != nullptr) {
+                std::cout << slots[i].user << ' ' << slots[i].size << std::endl;
+            }
+        }
+    }
+
+#endif
+
+    bool isInAllocRange(void *p) const override {
+        if (toByte(p) < region || toByte(p) >= region + REGION_SIZE) {
+            return false;
+        }
+        return slots[(toByte(p) - region) / (2 * pageSize())].user == p;
+    }
+
+    size_t maxAllocSize() const override {
+        return pageSize();
+    }
+};
+
+#endif //ALLOCATOR_GUARDEDALLOCATOR_H
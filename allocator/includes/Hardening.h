@@ -0,0 +1,107 @@
+//
+// Created by ko on 27.12.2020.
+//
+
+#ifndef ALLOCATOR_HARDENING_H
+#define ALLOCATOR_HARDENING_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+// rare paths of the hardened mode stay out of line, so they do not bloat the inlined fast paths
+#ifdef _MSC_VER
+#define HARDENED_NOINLINE __declspec(noinline)
+#else
+#define HARDENED_NOINLINE __attribute__((noinline))
+#endif
+
+/*
+ * HARDENED turns on checks cheap enough for production, independently of DEBUG and of the block layout:
+ * fixed size pages keep a bitmap of live blocks which catches double and invalid frees
+ * (coalesce blocks are checked by the consumed flag of their header, blocks in magazines of MemoryAllocator
+ * by a random key in their first word),
+ * free lists of fixed size pages are handed out in a random order, and MemoryAllocator serves
+ * a random sample of small allocations from pages with a guard page behind them.
+ * A failed check aborts the process, it does not depend on assert.
+ */
+
+/*
+ * Process wide options of the hardened mode, they have effect only when HARDENED is defined
+ */
+struct HardeningOptions {
+    /*
+     * one in this many small allocations of MemoryAllocator goes to a guarded page on average, 0 turns it off.
+     * A sampled block costs a few system calls and a page fault, about a thousand fast path allocations.
+     */
+    size_t guardedSampleRate = 1 << 16;
+};
+
+inline HardeningOptions &hardeningOptions() {
+    static HardeningOptions options;
+    return options;
+}
+
+[[noreturn]] inline void hardenedFailure(const char *message) {
+    fprintf(stderr, "allocator: %s\n", message);
+    fflush(stderr);
+    std::abort();
+}
+
+// xorshift64*, good enough to make block order unpredictable and cheap enough to be drawn on every free
+class HardenedRandom {
+    uint64_t state;
+    uint64_t bits = 1; // unused bits of the last draw for nextBit below a stop bit
+
+public:
+    HardenedRandom() : HardenedRandom(reinterpret_cast<uintptr_t>(this)) {}
+
+    explicit HardenedRandom(uint64_t seed) {
+        state = seed ^ (uint64_t) std::chrono::high_resolution_clock::now().time_since_epoch().count();
+        state = state * 0x9e3779b97f4a7c15ull;
+        if (state == 0) state = 1;
+    }
+
+    inline uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545f4914f6cdd1dull;
+    }
+
+    // one draw serves 63 calls
+    inline uint64_t nextBit() {
+        if (bits == 1) {
+            bits = next() | (uint64_t) 1 << 63;
+        }
+        uint64_t bit = bits & 1;
+        bits >>= 1;
+        return bit;
+    }
+
+    // uniform enough in [0, bound) for bounds far below 2^32
+    inline size_t below(size_t bound) {
+        return (size_t) (((next() >> 32) * bound) >> 32);
+    }
+
+    // Fisher-Yates over short arrays, one draw gives indices for eight steps
+    template<typename T>
+    void shuffle(T *items, size_t n) {
+        uint64_t bits = 0;
+        for (size_t i = n, left = 0; i > 1; i--, left--) {
+            if (left == 0) {
+                bits = next();
+                left = 8;
+            }
+            size_t j = (size_t) (((bits & 0xff) * i) >> 8);
+            bits >>= 8;
+            T tmp = items[i - 1];
+            items[i - 1] = items[j];
+            items[j] = tmp;
+        }
+    }
+};
+
+#endif //ALLOCATOR_HARDENING_H
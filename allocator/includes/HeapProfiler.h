@@ -0,0 +1,270 @@
+//
+// Created by ko on 28.12.2020.
+//
+
+#ifndef ALLOCATOR_HEAPPROFILER_H
+#define ALLOCATOR_HEAPPROFILER_H
+
+#include "Hardening.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#ifdef WINDOWS
+#include <windows.h>
+#else
+#include <execinfo.h>
+#endif
+
+// frames of the profiler are skipped by count, so they must stay frames of their own
+#ifdef _MSC_VER
+#define HEAP_PROFILER_NOINLINE __declspec(noinline)
+#else
+#define HEAP_PROFILER_NOINLINE __attribute__((noinline))
+#endif
+
+/*
+ * Sampling heap profiler. Allocated bytes form a Poisson process with one sample per sampleRate bytes
+ * on average (as in tcmalloc), so a block of size s is sampled with probability 1 - exp(-s / sampleRate)
+ * whatever the sizes of the blocks around it. A sampled block keeps the stack trace of its allocation
+ * in a table of live samples until it is freed, traces are aggregated in buckets with alloc and free counts.
+ * writeProfile prints the legacy text heap profile which pprof reads and unsamples by itself.
+ *
+ * Tables live in the system heap, the profiler never allocates from the allocator it profiles.
+ * With sampling off alloc pays one relaxed load and free pays one more while sampled blocks are live.
+ */
+class HeapProfiler {
+public:
+    static const size_t MAX_DEPTH = 32;
+    static const size_t DEFAULT_SAMPLE_RATE = 512 * 1024;
+
+private:
+    struct Bucket {
+        size_t allocs = 0;
+        size_t allocBytes = 0;
+        size_t frees = 0;
+        size_t freeBytes = 0;
+    };
+
+    struct LiveSample {
+        Bucket *bucket;
+        size_t size;
+    };
+
+    // per thread bytes left to the next sample, one countdown serves all profilers of the thread
+    struct Countdown {
+        HardenedRandom random;
+        int64_t bytesLeft = 0;
+        bool started = false;
+    };
+
+    // counting filter of live sampled addresses, it lets frees of other blocks skip the lock
+    static const size_t FILTER_BITS = 12;
+    static const size_t FILTER_SIZE = 1 << FILTER_BITS;
+
+    std::atomic<size_t> sampleRate{0}; // mean bytes between samples, 0 when off
+    std::atomic<size_t> liveCount{0};
+    std::unique_ptr<std::atomic<uint32_t>[]> filter;
+    mutable std::mutex lock;
+    std::map<std::vector<void *>, Bucket> buckets; // keyed by return addresses, innermost first
+    std::unordered_map<void *, LiveSample> live;
+    size_t profileRate = 0; // rate of the samples in the tables, pprof needs one rate per profile
+
+private:
+    static inline size_t filterIndex(void *p) {
+        return (size_t) ((reinterpret_cast<uintptr_t>(p) >> 4) * 0x9e3779b97f4a7c15ull >> (64 - FILTER_BITS));
+    }
+
+    static inline Countdown &countdown() {
+        static thread_local Countdown value;
+        return value;
+    }
+
+    // exponentially distributed gap with mean rate
+    static int64_t nextGap(HardenedRandom &random, size_t rate) {
+        double u = ((random.next() >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+        double gap = -std::log(u) * (double) rate;
+        return gap < 1.0 ? 1 : gap > 1e18 ? (int64_t) 1e18 : (int64_t) gap;
+    }
+
+    // return addresses of the callers without the skip innermost frames
+    HEAP_PROFILER_NOINLINE static std::vector<void *> stackTrace(size_t skip) {
+        void *frames[MAX_DEPTH + 4];
+#ifdef WINDOWS
+        size_t depth = CaptureStackBackTrace(0, MAX_DEPTH + 4, frames, nullptr);
+#else
+        size_t depth = (size_t) backtrace(frames, MAX_DEPTH + 4);
+#endif
+        skip = std::min(skip, depth);
+        return std::vector<void *>(frames + skip, frames + std::min(depth, skip + MAX_DEPTH));
+    }
+
+    // counts a sampled block in the bucket of its stack trace and records it as live
+    void recordSample(void *p, size_t size, size_t rate, const std::vector<void *> &trace) {
+        std::lock_guard<std::mutex> guard(lock);
+        profileRate = rate;
+        Bucket &bucket = buckets[trace];
+        bucket.allocs++;
+        bucket.allocBytes += size;
+        live[p] = LiveSample{&bucket, size};
+        filter[filterIndex(p)].fetch_add(1, std::memory_order_relaxed);
+        liveCount.fetch_add(1, std::memory_order_release);
+    }
+
+    // the countdown has run out, or the thread has not drawn its first gap yet
+    HEAP_PROFILER_NOINLINE void sampleSlow(void *p, size_t size) {
+        Countdown &c = countdown();
+        size_t rate = sampleRate.load(std::memory_order_relaxed);
+        if (rate == 0) {
+            c.bytesLeft = 0; // turned off meanwhile
+            return;
+        }
+        if (!c.started) {
+            c.started = true;
+            c.bytesLeft += nextGap(c.random, rate);
+            if (c.bytesLeft >= 0) {
+                return;
+            }
+        }
+        c.bytesLeft = nextGap(c.random, rate);
+        if (p != nullptr) {
+            // stackTrace is called here and not in a tail position, so the trace always starts in the caller of sampleSlow
+            std::vector<void *> trace = stackTrace(2); // stackTrace and sampleSlow
+            recordSample(p, size, rate, trace);
+        }
+    }
+
+    void forgetSlow(void *p) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = live.find(p);
+        if (it == live.end()) {
+            return; // another block with the same filter index
+        }
+        it->second.bucket->frees++;
+        it->second.bucket->freeBytes += it->second.size;
+        live.erase(it);
+        filter[filterIndex(p)].fetch_sub(1, std::memory_order_relaxed);
+        liveCount.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    static void writeRecord(std::ostream &out, size_t inuseCount, size_t inuseBytes, size_t allocCount,
+                            size_t allocBytes) {
+        out << inuseCount << ": " << inuseBytes << " [" << allocCount << ": " << allocBytes << "] @";
+    }
+
+public:
+    HeapProfiler() : filter(new std::atomic<uint32_t>[FILTER_SIZE]) {
+        for (size_t i = 0; i < FILTER_SIZE; i++) {
+            filter[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // mean bytes between samples, 0 turns sampling off, blocks sampled before stay tracked until freed
+    void setSampleRate(size_t rate) {
+        sampleRate.store(rate, std::memory_order_relaxed);
+    }
+
+    size_t getSampleRate() const {
+        return sampleRate.load(std::memory_order_relaxed);
+    }
+
+    inline bool isSampling() const {
+        return sampleRate.load(std::memory_order_relaxed) != 0;
+    }
+
+    // called on every allocation while isSampling()
+    inline void onAlloc(void *p, size_t size) {
+        Countdown &c = countdown();
+        c.bytesLeft -= (int64_t) size;
+        if (c.bytesLeft < 0) {
+            sampleSlow(p, size);
+        }
+    }
+
+    // called on every free, cheap while no sampled block is live
+    inline void onFree(void *p) {
+        if (liveCount.load(std::memory_order_acquire) != 0 &&
+            filter[filterIndex(p)].load(std::memory_order_relaxed) != 0) {
+            forgetSlow(p);
+        }
+    }
+
+    size_t liveSamples() const {
+        return liveCount.load(std::memory_order_relaxed);
+    }
+
+    // live bytes estimated from the samples, each sample of size s stands for s / (1 - exp(-s / rate)) bytes
+    double estimatedLiveBytes() const {
+        std::lock_guard<std::mutex> guard(lock);
+        double bytes = 0;
+        for (const auto &sample : live) {
+            double size = (double) sample.second.size;
+            bytes += size / -std::expm1(-size / (double) profileRate);
+        }
+        return bytes;
+    }
+
+    /*
+     * Legacy pprof heap profile: a header with totals, one line per stack trace with live ("inuse")
+     * and cumulative allocated sample counts and bytes, then the memory map for symbolization.
+     * Counts are raw samples, pprof scales them by the rate written after heap_v2.
+     */
+    void writeProfile(std::ostream &out) const {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t inuseCount = 0, inuseBytes = 0, allocCount = 0, allocBytes = 0;
+        for (const auto &entry : buckets) {
+            inuseCount += entry.second.allocs - entry.second.frees;
+            inuseBytes += entry.second.allocBytes - entry.second.freeBytes;
+            allocCount += entry.second.allocs;
+            allocBytes += entry.second.allocBytes;
+        }
+        out << "heap profile: ";
+        writeRecord(out, inuseCount, inuseBytes, allocCount, allocBytes);
+        out << " heap_v2/" << (profileRate != 0 ? profileRate : getSampleRate()) << '\n';
+        for (const auto &entry : buckets) {
+            const Bucket &bucket = entry.second;
+            writeRecord(out, bucket.allocs - bucket.frees, bucket.allocBytes - bucket.freeBytes, bucket.allocs,
+                        bucket.allocBytes);
+            for (void *frame : entry.first) {
+                out << ' ' << frame;
+            }
+            out << '\n';
+        }
+        out << "\nMAPPED_LIBRARIES:\n";
+#ifdef __linux__
+        std::ifstream maps("/proc/self/maps");
+        out << maps.rdbuf();
+#endif
+        out.flush();
+    }
+
+    bool writeProfile(const char *path) const {
+        std::ofstream out(path);
+        writeProfile(out);
+        return (bool) out;
+    }
+
+    // drops every sample, the allocator must not be used meanwhile
+    void reset() {
+        std::lock_guard<std::mutex> guard(lock);
+        buckets.clear();
+        live.clear();
+        for (size_t i = 0; i < FILTER_SIZE; i++) {
+            filter[i].store(0, std::memory_order_relaxed);
+        }
+        liveCount.store(0, std::memory_order_relaxed);
+        profileRate = 0;
+    }
+};
+
+#endif //ALLOCATOR_HEAPPROFILER_H
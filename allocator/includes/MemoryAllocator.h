@@ -8,26 +8,291 @@
 #include "FixedSizeAllocator.h"
 #include "CoalesceAllocator.h"
 #include "PageAllocator.h"
+#include "ThreadCache.h"
+#include "PageMap.h"
+#include "Hardening.h"
+#include "GuardedAllocator.h"
+#include "HeapProfiler.h"
+#include "Numa.h"
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef DEBUG
+#include <iostream>
+#endif
+
+/*
+ * Every NUMA node has its own fixed size and coalesce arenas which pages are bound to the node.
+ * A thread takes blocks from the arenas of the node it ran on when it first used the allocator,
+ * a block freed by a thread of another node goes straight back to its home arena.
+ * Large blocks are shared by all nodes.
+ */
 class MemoryAllocator : public AbstractAllocator {
-    static const size_t N = 8;
-
-    FixedSizeAllocator fsa16;
-    FixedSizeAllocator fsa32;
-    FixedSizeAllocator fsa64;
-    FixedSizeAllocator fsa128;
-    FixedSizeAllocator fsa256;
-    FixedSizeAllocator fsa512;
-    CoalesceAllocator ca;
+public:
+    static const size_t MAX_SIZE_CLASSES = 32;
+    static const size_t SIZE_CLASS_GRANULARITY = 8;
+
+    // four classes per doubling, so no more than 25% of a block is wasted above 64 bytes
+    static std::vector<size_t> defaultSizeClasses() {
+        return {16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512};
+    }
+
+private:
+    typedef ThreadCache<MemoryAllocator, MAX_SIZE_CLASSES> Cache;
+    friend Cache;
+
+    const size_t classesCount;
+    const size_t nodesCount;
+    std::vector<FixedSizeAllocator> fsa; // arena of size class i of node k is fsa[k * classesCount + i]
+    std::vector<CoalesceAllocator> ca; // one per node
     PageAllocator pa;
-    AbstractAllocator **allocators;
+#ifdef HARDENED
+    GuardedAllocator guarded; // sampled small blocks
+    mutable std::mutex guardedLock;
+    // first word of every block in a magazine, checked when the block is handed out: a block freed twice
+    // is in magazines twice and loses the key when it is handed out the first time
+    uintptr_t magazineKey = 0;
+#endif
+    PageMap pageMap;
+    HeapProfiler profiler;
+    // size class of size is classBySize[(size + SIZE_CLASS_GRANULARITY - 1) / SIZE_CLASS_GRANULARITY]
+    std::vector<uint8_t> classBySize;
+    size_t maxSmallSize;
+
+    // fixed size allocators are shared between threads through per thread magazines,
+    // their locks are taken only for batch refills and flushes
+    std::unique_ptr<std::mutex[]> fsaLocks;
+    std::unique_ptr<std::mutex[]> caLocks;
+    Cache *caches = nullptr; // registry of thread caches, guarded by Cache::registryMutex()
+    // counters of caches of exited threads, guarded by Cache::registryMutex()
+    std::vector<size_t> retiredAllocs;
+    std::vector<size_t> retiredFrees;
+    std::vector<size_t> refillsAndFlushes; // of every fixed size arena, remote frees included, guarded by fsaLocks
+    size_t epoch = 0;
 
     bool initialized = false;
 
+private:
+    static size_t nextEpoch() {
+        static std::atomic<size_t> counter(0);
+        return ++counter;
+    }
+
+    inline Cache *threadCache() {
+        return Cache::threadList().find(this, epoch);
+    }
+
+    void refill(size_t arena, Magazine &magazine) {
+        std::lock_guard<std::mutex> lock(fsaLocks[arena]);
+        refillsAndFlushes[arena]++;
+        fsa[arena].allocBulk(Magazine::BATCH - magazine.count, magazine.blocks + magazine.count);
+#ifdef HARDENED
+        for (size_t j = magazine.count; j < Magazine::BATCH; j++) {
+            *static_cast<uintptr_t *>(magazine.blocks[j]) = magazineKey;
+        }
+#endif
+        magazine.count = Magazine::BATCH;
+    }
+
+    void flush(size_t arena, Magazine &magazine, size_t count) {
+        std::lock_guard<std::mutex> lock(fsaLocks[arena]);
+        refillsAndFlushes[arena]++;
+        count = std::min(count, magazine.count);
+        magazine.count -= count;
+        fsa[arena].freeBulk(magazine.blocks + magazine.count, count);
+    }
+
+    // must be called under Cache::registryMutex()
+    void registerThreadCache(Cache *cache) {
+        cache->node = nodesCount == 1 ? 0 : currentNumaNode() % nodesCount;
+#ifdef HARDENED
+        cache->sampleCountdown = nextSampleCountdown();
+#endif
+        cache->prevInOwner = nullptr;
+        cache->nextInOwner = caches;
+        if (caches) caches->prevInOwner = cache;
+        caches = cache;
+    }
+
+    // must be called under Cache::registryMutex()
+    void releaseThreadCache(Cache *cache) {
+        for (size_t i = 0; i < classesCount; i++) {
+            flush(arenaOf(cache, i), cache->magazines[i], Magazine::CAPACITY);
+            retiredAllocs[i] += cache->magazines[i].allocs.load(std::memory_order_relaxed);
+            retiredFrees[i] += cache->magazines[i].frees.load(std::memory_order_relaxed);
+        }
+        if (cache->prevInOwner) cache->prevInOwner->nextInOwner = cache->nextInOwner;
+        if (cache->nextInOwner) cache->nextInOwner->prevInOwner = cache->prevInOwner;
+        if (caches == cache) caches = cache->nextInOwner;
+        cache->owner = nullptr;
+    }
+
+    // fixed size arena of size class i on the node of cache
+    inline size_t arenaOf(const Cache *cache, size_t i) const {
+        return cache->node * classesCount + i;
+    }
+
+    // owner must be one of fixed size allocators
+    inline size_t fixedSizeArena(AbstractAllocator *owner) {
+        return static_cast<FixedSizeAllocator *>(owner) - fsa.data();
+    }
+
+    // node of the coalesce allocator owner, nodesCount if owner is not a coalesce allocator
+    inline size_t coalesceNode(const AbstractAllocator *owner) const {
+        for (size_t k = 0; k < nodesCount; k++) {
+            if (owner == &ca[k]) {
+                return k;
+            }
+        }
+        return nodesCount;
+    }
+
+    // node which arenas serve the calling thread
+    inline size_t threadNode() {
+        return nodesCount == 1 ? 0 : threadCache()->node;
+    }
+
+    // a block of another node skips the magazine, so it is reused on its home node only
+    void freeRemote(Cache *cache, size_t arena, void *p) {
+        Magazine::increment(cache->magazines[arena % classesCount].frees);
+        std::lock_guard<std::mutex> lock(fsaLocks[arena]);
+        refillsAndFlushes[arena]++;
+        fsa[arena].free(p);
+    }
+
+    inline size_t sizeClass(size_t size) const {
+        return classBySize[(size + SIZE_CLASS_GRANULARITY - 1) / SIZE_CLASS_GRANULARITY];
+    }
+
+    inline void *allocSmall(size_t i) {
+        return allocSmall(threadCache(), i);
+    }
+
+    inline void *allocSmall(Cache *cache, size_t i) {
+        Magazine &magazine = cache->magazines[i];
+        if (magazine.isEmpty()) {
+            refill(arenaOf(cache, i), magazine);
+        }
+        Magazine::increment(magazine.allocs);
+#ifdef HARDENED
+        void *p = magazine.pop();
+        uintptr_t &key = *static_cast<uintptr_t *>(p);
+        if (key != magazineKey) {
+            hardenedFailure("double free or write to a freed block");
+        }
+        key = 0;
+        return p;
+#else
+        return magazine.pop();
+#endif
+    }
+
+#ifdef HARDENED
+
+    // allocations of a thread between two sampled ones, hardeningOptions().guardedSampleRate on average
+    static size_t nextSampleCountdown() {
+        static thread_local HardenedRandom random;
+        size_t rate = hardeningOptions().guardedSampleRate;
+        return rate == 0 ? SIZE_MAX : 1 + random.below(2 * rate);
+    }
+
+    // the block goes the usual way when every guarded slot is taken
+    HARDENED_NOINLINE void *allocSampled(Cache *cache, size_t size) {
+        cache->sampleCountdown = nextSampleCountdown();
+        if (hardeningOptions().guardedSampleRate != 0 && size <= guarded.maxAllocSize()) {
+            std::lock_guard<std::mutex> lock(guardedLock);
+            void *p = guarded.alloc(size);
+            if (p != nullptr) {
+                return p;
+            }
+        }
+        return allocSmall(cache, sizeClass(size));
+    }
+
+#endif
+
+    void *allocBlock(size_t size) {
+        if (size <= maxSmallSize) {
+#ifdef HARDENED
+            // the countdown lives in the thread cache, so sampling costs no extra thread local lookup
+            Cache *cache = threadCache();
+            if (--cache->sampleCountdown == 0) {
+                return allocSampled(cache, size);
+            }
+            return allocSmall(cache, sizeClass(size));
+#else
+            return allocSmall(sizeClass(size));
+#endif
+        }
+        if (size < ca[0].maxAllocSize()) {
+            size_t k = threadNode();
+            std::lock_guard<std::mutex> lock(caLocks[k]);
+            return ca[k].alloc(size);
+        }
+        return pa.alloc(size);
+    }
+
+    void *allocAlignedBlock(size_t size, size_t alignment) {
+        if (size <= maxSmallSize) {
+            for (size_t i = sizeClass(size); i < classesCount; i++) {
+                if (fsa[i].blockAlignment() >= alignment) {
+                    return allocSmall(i);
+                }
+            }
+        }
+        if (size < ca[0].maxAlignedAllocSize(alignment)) {
+            size_t k = threadNode();
+            std::lock_guard<std::mutex> lock(caLocks[k]);
+            return ca[k].allocAligned(size, alignment);
+        }
+        return pa.allocAligned(size, alignment);
+    }
+
 public:
-    MemoryAllocator() : fsa16(16), fsa32(32), fsa64(64), fsa128(128),
-                        fsa256(256), fsa512(512), ca(), pa() {
-        allocators = new AbstractAllocator *[N]{&fsa16, &fsa32, &fsa64, &fsa128, &fsa256, &fsa512, &ca, &pa};
+    MemoryAllocator() : MemoryAllocator(defaultSizeClasses()) {}
+
+    /*
+     * classSizes are block sizes of fixed size allocators in ascending order, multiples of SIZE_CLASS_GRANULARITY.
+     * Bigger blocks go to the coalesce allocator and the page allocator.
+     * Arenas are made for every node numaNodeCount() reports at this moment.
+     */
+    explicit MemoryAllocator(const std::vector<size_t> &classSizes) : classesCount(classSizes.size()),
+                                                                      nodesCount(numaNodeCount()), pa(),
+                                                                      fsaLocks(new std::mutex[classesCount * nodesCount]),
+                                                                      caLocks(new std::mutex[nodesCount]),
+                                                                      retiredAllocs(classesCount),
+                                                                      retiredFrees(classesCount),
+                                                                      refillsAndFlushes(classesCount * nodesCount) {
+        assert(classesCount > 0 && classesCount <= MAX_SIZE_CLASSES);
+        // page map keeps pointers to the allocators, so the vectors never reallocate
+        fsa.reserve(classesCount * nodesCount);
+        ca.reserve(nodesCount);
+        for (size_t k = 0; k < nodesCount; k++) {
+            for (size_t i = 0; i < classesCount; i++) {
+                assert(classSizes[i] % SIZE_CLASS_GRANULARITY == 0);
+                assert(i == 0 || classSizes[i - 1] < classSizes[i]);
+                fsa.emplace_back(classSizes[i]);
+                fsa.back().setPageMap(&pageMap);
+                if (nodesCount > 1) fsa.back().setNumaNode(k);
+            }
+            ca.emplace_back();
+            ca.back().setPageMap(&pageMap);
+            if (nodesCount > 1) ca.back().setNumaNode(k);
+        }
+#ifdef HARDENED
+        guarded.setPageMap(&pageMap);
+#endif
+
+        maxSmallSize = classSizes.back();
+        classBySize.resize(maxSmallSize / SIZE_CLASS_GRANULARITY + 1);
+        for (size_t i = 0, c = 0; i < classBySize.size(); i++) {
+            while (classSizes[c] < i * SIZE_CLASS_GRANULARITY) c++;
+            classBySize[i] = static_cast<uint8_t>(c);
+        }
     }
 
     ~MemoryAllocator() {
@@ -35,45 +300,239 @@ public:
         if (initialized) {
             destroy();
         }
-        delete[] allocators;
     }
 
+    /*
+     * init and destroy are not thread safe: no other thread may use the allocator meanwhile.
+     * alloc and free may be called from any thread, a block may be freed by a thread other than its allocator.
+     */
     void init() override {
-        for (int i = 0; i < 8; i++) {
-            allocators[i]->init();
+        pageMap.init();
+        for (FixedSizeAllocator &a : fsa) {
+            a.init();
+        }
+        for (CoalesceAllocator &a : ca) {
+            a.init();
         }
+        pa.init();
+#ifdef HARDENED
+        guarded.init();
+        magazineKey = (uintptr_t) HardenedRandom().next() | 1;
+#endif
+        epoch = nextEpoch();
         initialized = true;
     }
 
     void destroy() override final {
-        for (int i = 0; i < 8; i++) {
-            allocators[i]->destroy();
+        {
+            std::lock_guard<std::mutex> lock(Cache::registryMutex());
+            while (caches != nullptr) {
+                releaseThreadCache(caches);
+            }
+        }
+        for (FixedSizeAllocator &a : fsa) {
+            a.destroy();
+        }
+        for (CoalesceAllocator &a : ca) {
+            a.destroy();
         }
+        pa.destroy();
+#ifdef HARDENED
+        guarded.destroy();
+#endif
+        for (size_t i = 0; i < classesCount; i++) {
+            retiredAllocs[i] = retiredFrees[i] = 0;
+        }
+        std::fill(refillsAndFlushes.begin(), refillsAndFlushes.end(), 0);
+        pageMap.destroy();
+        profiler.reset();
         initialized = false;
     }
 
     void *alloc(size_t size) override {
-        for (int i = 0; i < 8; i++) {
-            if (size < allocators[i]->maxAllocSize()) {
-                return allocators[i]->alloc(size);
-            }
+        void *p = allocBlock(size);
+        if (profiler.isSampling()) {
+            profiler.onAlloc(p, size);
         }
-        return nullptr;
+        return p;
+    }
+
+    /*
+     * Small blocks go to the first size class which fits the size and which blocks are aligned enough,
+     * so cache line aligned objects of a cache line size take no extra space
+     */
+    void *allocAligned(size_t size, size_t alignment) override {
+        assert(alignment && !(alignment & (alignment - 1)));
+        void *p = allocAlignedBlock(size, alignment);
+        if (profiler.isSampling()) {
+            profiler.onAlloc(p, size);
+        }
+        return p;
     }
 
     void free(void *p) override {
-        for (int i = 0; i < 8; i++) {
-            if (allocators[i]->isInAllocRange(p)) {
-                allocators[i]->free(p);
+        profiler.onFree(p);
+        AbstractAllocator *owner = pageMap.find(p);
+        if (owner == nullptr) {
+            pa.free(p); // large blocks are not registered in the page map
+            return;
+        }
+#ifdef HARDENED
+        if (owner == &guarded) {
+            std::lock_guard<std::mutex> lock(guardedLock);
+            guarded.free(p);
+            return;
+        }
+#endif
+        size_t k = coalesceNode(owner);
+        if (k == nodesCount) {
+            size_t arena = fixedSizeArena(owner);
+            Cache *cache = threadCache();
+            size_t i = arena - cache->node * classesCount;
+            if (i >= classesCount) {
+                freeRemote(cache, arena, p);
                 return;
             }
+            Magazine &magazine = cache->magazines[i];
+#ifdef HARDENED
+            // a block back in the free list of its page has its live bit cleared, a second free of a block
+            // still in a magazine is caught when one of its copies is handed out
+            static_cast<FixedSizeAllocator *>(owner)->checkLive(p);
+#endif
+            if (magazine.isFull()) {
+                flush(arena, magazine, Magazine::BATCH);
+            }
+#ifdef HARDENED
+            *static_cast<uintptr_t *>(p) = magazineKey; // overwritten by the free list link when flushed
+#endif
+            Magazine::increment(magazine.frees);
+            magazine.push(p);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(caLocks[k]);
+        ca[k].free(p);
+    }
+
+    size_t usableSize(void *p) const override {
+        AbstractAllocator *owner = pageMap.find(p);
+        if (owner == nullptr) {
+            return pa.usableSize(p);
+        }
+        size_t k = coalesceNode(owner);
+        if (k == nodesCount) {
+            return owner->usableSize(p);
+        }
+        std::lock_guard<std::mutex> lock(caLocks[k]);
+        return ca[k].usableSize(p);
+    }
+
+    bool tryExpandInPlace(void *p, size_t size) override {
+        AbstractAllocator *owner = pageMap.find(p);
+        if (owner == nullptr) {
+            return pa.tryExpandInPlace(p, size);
+        }
+        size_t k = coalesceNode(owner);
+        if (k == nodesCount) {
+            return size <= owner->usableSize(p);
+        }
+        std::lock_guard<std::mutex> lock(caLocks[k]);
+        return ca[k].tryExpandInPlace(p, size);
+    }
+
+    void *realloc(void *p, size_t size) override {
+        if (p != nullptr && size >= ca[0].maxAllocSize() && pageMap.find(p) == nullptr) {
+            profiler.onFree(p);
+            void *moved = pa.realloc(p, size); // large block stays large, its pages are remapped
+            if (profiler.isSampling()) {
+                profiler.onAlloc(moved, size);
+            }
+            return moved;
+        }
+        return AbstractAllocator::realloc(p, size);
+    }
+
+    /*
+     * allocs, frees and live bytes of size classes are counted by user operations, while pages,
+     * peak and slow path hits (magazine refills and flushes) come from the shared arenas of all nodes.
+     * Peaks of total is the sum of peaks of its parts. Stats of nodes are counted by their arenas,
+     * so blocks held in magazines are live there.
+     */
+    MemoryAllocatorStats detailedStats() const {
+        MemoryAllocatorStats snapshot;
+        snapshot.sizeClasses.resize(classesCount);
+        {
+            std::lock_guard<std::mutex> lock(Cache::registryMutex());
+            for (size_t i = 0; i < classesCount; i++) {
+                snapshot.sizeClasses[i].allocs = retiredAllocs[i];
+                snapshot.sizeClasses[i].frees = retiredFrees[i];
+            }
+            for (Cache *cache = caches; cache != nullptr; cache = cache->nextInOwner) {
+                for (size_t i = 0; i < classesCount; i++) {
+                    snapshot.sizeClasses[i].allocs += cache->magazines[i].allocs.load(std::memory_order_relaxed);
+                    snapshot.sizeClasses[i].frees += cache->magazines[i].frees.load(std::memory_order_relaxed);
+                }
+            }
+        }
+        snapshot.nodes.resize(nodesCount);
+        for (size_t i = 0; i < classesCount; i++) {
+            SizeClassStats &sizeClass = snapshot.sizeClasses[i];
+            sizeClass.blockSize = fsa[i].maxAllocSize();
+            sizeClass.bytesLive = (sizeClass.allocs - sizeClass.frees) * sizeClass.blockSize;
+            for (size_t k = 0; k < nodesCount; k++) {
+                size_t a = k * classesCount + i;
+                std::lock_guard<std::mutex> lock(fsaLocks[a]);
+                AllocatorStats arena = fsa[a].stats();
+                sizeClass.peakBytesLive += arena.peakBytesLive;
+                sizeClass.pages += arena.pages;
+                sizeClass.bytesMapped += arena.bytesMapped;
+                sizeClass.slowPathHits += refillsAndFlushes[a];
+                snapshot.nodes[k] += arena;
+            }
+            snapshot.total += sizeClass;
+        }
+        for (size_t k = 0; k < nodesCount; k++) {
+            std::lock_guard<std::mutex> lock(caLocks[k]);
+            AllocatorStats arena = ca[k].stats();
+            snapshot.coalesce += arena;
+            snapshot.nodes[k] += arena;
         }
+        snapshot.page = pa.stats();
+        snapshot.total += snapshot.coalesce;
+        snapshot.total += snapshot.page;
+#ifdef HARDENED
+        {
+            std::lock_guard<std::mutex> lock(guardedLock);
+            snapshot.total += guarded.stats();
+        }
+#endif
+        return snapshot;
+    }
+
+    AllocatorStats stats() const override {
+        return detailedStats().total;
+    }
+
+    // sampling is off until heapProfiler().setSampleRate is called, samples are dropped on destroy
+    HeapProfiler &heapProfiler() {
+        return profiler;
     }
 
 #ifdef DEBUG
 
     void dumpStat() const override {
-
+        MemoryAllocatorStats snapshot = detailedStats();
+        for (const SizeClassStats &sizeClass : snapshot.sizeClasses) {
+            std::cout << "Class " << sizeClass.blockSize << ": live " << sizeClass.bytesLive
+                      << " / " << sizeClass.bytesMapped << "; allocs " << sizeClass.allocs
+                      << "; frees " << sizeClass.frees << std::endl;
+        }
+        std::cout << "Coalesce: live " << snapshot.coalesce.bytesLive << " / " << snapshot.coalesce.bytesMapped << std::endl;
+        std::cout << "Page: live " << snapshot.page.bytesLive << std::endl;
+        for (size_t k = 0; k < nodesCount; k++) {
+            std::cout << "Node " << k << ": live " << snapshot.nodes[k].bytesLive
+                      << " / " << snapshot.nodes[k].bytesMapped << std::endl;
+        }
+        std::cout << "Fragmentation: " << snapshot.total.fragmentation() << std::endl;
     }
 
     void dumpBlock() const override {
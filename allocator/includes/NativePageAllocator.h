@@ -6,23 +6,123 @@
 #define ALLOCATOR_NATIVEPAGEALLOCATOR_H
 
 #include <cstddef>
+#include <cstdint>
 
 #ifdef WINDOWS
 #include <windows.h>
 #include <memoryapi.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Process wide options of the OS page backend, they are read when a page is mapped,
+ * so changing them affects only pages mapped afterwards
+ */
+struct PageOptions {
+    // madvise(MADV_HUGEPAGE) on mapped pages, so transparent huge pages back them even in "madvise" mode
+    bool transparentHugePages = false;
+    // MAP_HUGETLB for pages which size is a multiple of HUGE_PAGE_SIZE, falls back to normal pages
+    // when no huge pages are reserved in the system
+    bool hugeTLB = false;
+    // allocators reserve address space for their pages and commit it gradually while the page fills
+    bool lazyCommit = false;
+};
+
+static const size_t HUGE_PAGE_SIZE = 1 << 21;
+
+inline PageOptions &pageOptions() {
+    static PageOptions options;
+    return options;
+}
+
+inline size_t systemPageSize() {
+#ifdef WINDOWS
+    static size_t size = []() {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return (size_t) info.dwPageSize;
+    }();
+#else
+    static size_t size = (size_t) sysconf(_SC_PAGESIZE);
 #endif
+    return size;
+}
 
-void *allocPage(size_t size) {
 #ifdef WINDOWS
-    return VirtualAlloc(
-            NULL,
-            size,
-            MEM_COMMIT,
-            PAGE_READWRITE
-        );
+
+inline void *mapPages(size_t size, size_t alignment, bool commit) {
+    DWORD type = commit ? MEM_RESERVE | MEM_COMMIT : MEM_RESERVE;
+    DWORD protect = commit ? PAGE_READWRITE : PAGE_NOACCESS;
+    void *p = VirtualAlloc(NULL, size, type, protect);
+    if (p == NULL || reinterpret_cast<uintptr_t>(p) % alignment == 0) {
+        return p;
+    }
+    // there is no partial release, so an aligned range is found by reserving more and mapping inside it
+    VirtualFree(p, 0, MEM_RELEASE);
+    for (int attempt = 0; attempt < 16; attempt++) {
+        void *range = VirtualAlloc(NULL, size + alignment, MEM_RESERVE, PAGE_NOACCESS);
+        if (range == NULL) {
+            return NULL;
+        }
+        uintptr_t aligned = (reinterpret_cast<uintptr_t>(range) + alignment - 1) & ~(uintptr_t) (alignment - 1);
+        VirtualFree(range, 0, MEM_RELEASE);
+        p = VirtualAlloc(reinterpret_cast<void *>(aligned), size, type, protect);
+        if (p != NULL) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
 #else
-    return malloc(size); //mmap
+
+inline void *mapPages(size_t size, size_t alignment, int prot, int flags, size_t granularity) {
+    size_t extra = alignment > granularity ? alignment : 0;
+    void *p = mmap(nullptr, size + extra, prot, flags | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return nullptr;
+    }
+    if (extra == 0) {
+        return p;
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(p);
+    uintptr_t aligned = (start + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    if (aligned > start) {
+        munmap(p, aligned - start);
+    }
+    if (extra > aligned - start) {
+        munmap(reinterpret_cast<void *>(aligned + size), extra - (aligned - start));
+    }
+    return reinterpret_cast<void *>(aligned);
+}
+
+inline void *mapPages(size_t size, size_t alignment, bool commit) {
+    const PageOptions &options = pageOptions();
+    void *p = nullptr;
+#ifdef MAP_HUGETLB
+    if (commit && options.hugeTLB && size % HUGE_PAGE_SIZE == 0 && alignment % HUGE_PAGE_SIZE == 0) {
+        p = mapPages(size, alignment, PROT_READ | PROT_WRITE, MAP_HUGETLB, HUGE_PAGE_SIZE);
+        if (p != nullptr) {
+            return p;
+        }
+    }
+#endif
+    p = commit ? mapPages(size, alignment, PROT_READ | PROT_WRITE, 0, systemPageSize())
+               : mapPages(size, alignment, PROT_NONE, MAP_NORESERVE, systemPageSize());
+#ifdef MADV_HUGEPAGE
+    if (p != nullptr && options.transparentHugePages) {
+        madvise(p, size, MADV_HUGEPAGE);
+    }
+#endif
+    return p;
+}
+
 #endif
+
+inline void *allocPage(size_t size) {
+    return mapPages(size, 1, true);
 }
 
 template<typename T>
@@ -30,15 +130,84 @@ inline T *allocPage(size_t size) {
     return reinterpret_cast<T *>(allocPage(size));
 }
 
-void freePage(void *p, size_t size) {
+inline void freePage(void *p, size_t size) {
+#ifdef WINDOWS
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, size);
+#endif
+}
+
+/*
+ * Page which start is a multiple of alignment (power of two), so the page header
+ * can be found from any inner pointer by address masking
+ */
+inline void *allocAlignedPage(size_t size, size_t alignment) {
+    return mapPages(size, alignment, true);
+}
+
+template<typename T>
+inline T *allocAlignedPage(size_t size, size_t alignment) {
+    return reinterpret_cast<T *>(allocAlignedPage(size, alignment));
+}
+
+inline void freeAlignedPage(void *p, size_t size) {
+    freePage(p, size);
+}
+
+/*
+ * Aligned address range without memory behind it, parts of it must be committed before use.
+ * Released with freeAlignedPage.
+ */
+inline void *reserveAlignedPage(size_t size, size_t alignment) {
+    return mapPages(size, alignment, false);
+}
+
+template<typename T>
+inline T *reserveAlignedPage(size_t size, size_t alignment) {
+    return reinterpret_cast<T *>(reserveAlignedPage(size, alignment));
+}
+
+// makes every system page intersecting [p, p + size) usable
+inline void commitPage(void *p, size_t size) {
+    uintptr_t mask = systemPageSize() - 1;
+    uintptr_t start = reinterpret_cast<uintptr_t>(p) & ~mask;
+    uintptr_t end = (reinterpret_cast<uintptr_t>(p) + size + mask) & ~mask;
+#ifdef WINDOWS
+    VirtualAlloc(reinterpret_cast<void *>(start), end - start, MEM_COMMIT, PAGE_READWRITE);
+#else
+    mprotect(reinterpret_cast<void *>(start), end - start, PROT_READ | PROT_WRITE);
+#endif
+}
+
+/*
+ * Returns memory of every system page lying inside [p, p + size) to the OS, the range
+ * keeps its address space and must be committed again before the next use
+ */
+inline void decommitPage(void *p, size_t size) {
+    uintptr_t mask = systemPageSize() - 1;
+    uintptr_t start = (reinterpret_cast<uintptr_t>(p) + mask) & ~mask;
+    uintptr_t end = (reinterpret_cast<uintptr_t>(p) + size) & ~mask;
+    if (start >= end) {
+        return;
+    }
+#ifdef WINDOWS
+    VirtualFree(reinterpret_cast<void *>(start), end - start, MEM_DECOMMIT);
+#else
+    madvise(reinterpret_cast<void *>(start), end - start, MADV_DONTNEED);
+#endif
+}
+
+/*
+ * Returns memory of [p, p + size) to the OS and makes the range inaccessible, so any access faults.
+ * p and size must be multiples of the system page size, commitPage makes the range usable again.
+ */
+inline void guardPage(void *p, size_t size) {
 #ifdef WINDOWS
-    VirtualFree(
-            p,
-            size,
-            MEM_RELEASE
-        );
+    VirtualFree(p, size, MEM_DECOMMIT);
 #else
-    free(p);
+    madvise(p, size, MADV_DONTNEED);
+    mprotect(p, size, PROT_NONE);
 #endif
 }
 
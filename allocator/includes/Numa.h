@@ -0,0 +1,143 @@
+//
+// Created by ko on 29.12.2020.
+//
+
+#ifndef ALLOCATOR_NUMA_H
+#define ALLOCATOR_NUMA_H
+
+#include <cstddef>
+#include <cstdio>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Process wide NUMA options, they are read when an allocator is created and when a thread
+ * first uses it, so changing them affects only allocators and threads seen afterwards
+ */
+struct NumaOptions {
+    // pretend the machine has this many nodes, 0 uses the real topology.
+    // CPU c belongs to node c % simulatedNodes then and pages are not bound to nodes.
+    size_t simulatedNodes = 0;
+};
+
+inline NumaOptions &numaOptions() {
+    static NumaOptions options;
+    return options;
+}
+
+#ifdef __linux__
+
+// calls f for every number of a sysfs list such as "0-3,8-11", false if the file can not be read
+template<typename F>
+inline bool forEachInSysfsList(const char *path, F f) {
+    FILE *file = fopen(path, "r");
+    if (file == nullptr) {
+        return false;
+    }
+    size_t first, last;
+    char separator;
+    while (fscanf(file, "%zu", &first) == 1) {
+        last = first;
+        if (fscanf(file, "%c", &separator) == 1 && separator == '-' && fscanf(file, "%zu", &last) == 1) {
+            fscanf(file, "%c", &separator);
+        }
+        for (size_t i = first; i <= last; i++) {
+            f(i);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+#endif
+
+// real nodes of the machine, 1 where NUMA is not supported
+inline size_t systemNumaNodeCount() {
+#ifdef __linux__
+    static size_t count = []() {
+        size_t nodes = 1;
+        forEachInSysfsList("/sys/devices/system/node/online", [&nodes](size_t node) {
+            nodes = node + 1 > nodes ? node + 1 : nodes;
+        });
+        return nodes;
+    }();
+    return count;
+#else
+    return 1;
+#endif
+}
+
+inline size_t numaNodeCount() {
+    size_t simulated = numaOptions().simulatedNodes;
+    return simulated != 0 ? simulated : systemNumaNodeCount();
+}
+
+// node set by pinThreadToNumaNode or -1
+inline int &pinnedNumaNode() {
+    static thread_local int node = -1;
+    return node;
+}
+
+// node of the CPU the calling thread runs on, a thread may migrate, so it is a hint
+inline size_t currentNumaNode() {
+    int pinned = pinnedNumaNode();
+    if (pinned >= 0) {
+        return (size_t) pinned % numaNodeCount();
+    }
+#ifdef __linux__
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+        return 0;
+    }
+    size_t simulated = numaOptions().simulatedNodes;
+    return simulated != 0 ? cpu % simulated : node;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Runs the calling thread on CPUs of node from now on. With simulated nodes only
+ * the node reported by currentNumaNode changes, which is what tests need.
+ */
+inline bool pinThreadToNumaNode(size_t node) {
+    pinnedNumaNode() = (int) node;
+#ifdef __linux__
+    if (numaOptions().simulatedNodes != 0) {
+        return true;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", node);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    bool read = forEachInSysfsList(path, [&cpus](size_t cpu) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &cpus);
+    });
+    return read && sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+#else
+    return true;
+#endif
+}
+
+/*
+ * Asks the kernel to take physical pages of [p, p + size) from node when they are first touched,
+ * other nodes are used when it runs out of memory. p must be page aligned.
+ */
+inline void bindToNumaNode(void *p, size_t size, size_t node) {
+#ifdef __linux__
+    static const int PREFERRED = 1; // MPOL_PREFERRED of numaif.h, which is a part of libnuma
+    static const size_t MASK_BITS = 1024;
+    if (numaOptions().simulatedNodes != 0 || systemNumaNodeCount() == 1 || node >= MASK_BITS) {
+        return;
+    }
+    unsigned long mask[MASK_BITS / (8 * sizeof(unsigned long))] = {};
+    mask[node / (8 * sizeof(unsigned long))] = 1ul << node % (8 * sizeof(unsigned long));
+    syscall(SYS_mbind, p, size, PREFERRED, mask, MASK_BITS, 0);
+#endif
+}
+
+#endif //ALLOCATOR_NUMA_H
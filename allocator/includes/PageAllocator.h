@@ -5,31 +5,415 @@
 #ifndef ALLOCATOR_PAGEALLOCATOR_H
 #define ALLOCATOR_PAGEALLOCATOR_H
 
+#include "AbstractAllocator.h"
+#include "NativePageAllocator.h"
+#include "AllocatorStats.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+
+#ifdef DEBUG
+#include <iostream>
+#endif
+
+/*
+ * Large blocks as spans of whole system pages. A block starts at its span, so it is page aligned
+ * and has no header: span sizes are kept out of band in a hash table keyed by address.
+ * Freed spans are kept in a small cache and handed out again to requests of about their size,
+ * a bigger cached span is split, so churn of big buffers does not map and fault pages again.
+ * Thread safe, the state is behind one mutex which is never held during a system call.
+ */
 class PageAllocator : public AbstractAllocator {
 public:
-    void init() override {}
+    static const size_t DEFAULT_MAX_CACHED_BYTES = (size_t) 256 << 20;
+    static const size_t MAX_CACHED_SPANS = 32;
+
+private:
+    struct Span {
+        byte *start; // nullptr in a free slot of SpanTable
+        size_t size;
+        size_t granularity; // a span is split and unmapped only at multiples of it
+    };
+
+    // open addressing with linear probing, its memory comes from the OS as well
+    class SpanTable {
+        static const size_t MIN_CAPACITY = 256;
+
+        Span *slots = nullptr;
+        size_t capacity = 0;
+        size_t count = 0;
+
+    public:
+        size_t size() const {
+            return count;
+        }
+
+    private:
+        inline size_t home(const void *p) const {
+            return (size_t) ((reinterpret_cast<uintptr_t>(p) >> 12) * 0x9e3779b97f4a7c15ull) & (capacity - 1);
+        }
+
+        void resize(size_t newCapacity) {
+            Span *old = slots;
+            size_t oldCapacity = capacity;
+            slots = allocPage<Span>(newCapacity * sizeof(Span));
+            capacity = newCapacity;
+            for (size_t i = 0; i < capacity; i++) {
+                slots[i].start = nullptr;
+            }
+            count = 0;
+            for (size_t i = 0; i < oldCapacity; i++) {
+                if (old[i].start != nullptr) {
+                    insert(old[i]);
+                }
+            }
+            if (old != nullptr) {
+                freePage(old, oldCapacity * sizeof(Span));
+            }
+        }
+
+        inline size_t indexOf(const void *p) const {
+            size_t i = home(p);
+            while (slots[i].start != p && slots[i].start != nullptr) {
+                i = (i + 1) & (capacity - 1);
+            }
+            assert(slots[i].start == p); // otherwise p is not a block of this allocator
+            return i;
+        }
+
+    public:
+        void init() {
+            resize(MIN_CAPACITY);
+        }
+
+        void destroy() {
+            freePage(slots, capacity * sizeof(Span));
+            slots = nullptr;
+            capacity = count = 0;
+        }
+
+        void insert(Span span) {
+            if (2 * (count + 1) > capacity) {
+                resize(2 * capacity);
+            }
+            size_t i = home(span.start);
+            while (slots[i].start != nullptr) {
+                i = (i + 1) & (capacity - 1);
+            }
+            slots[i] = span;
+            count++;
+        }
+
+        inline Span &find(const void *p) {
+            return slots[indexOf(p)];
+        }
 
-    void destroy() override {}
+        inline const Span &find(const void *p) const {
+            return slots[indexOf(p)];
+        }
+
+        // backward shift deletion, so lookups need no tombstones
+        void erase(const void *p) {
+            size_t hole = indexOf(p);
+            for (size_t i = (hole + 1) & (capacity - 1); slots[i].start != nullptr; i = (i + 1) & (capacity - 1)) {
+                size_t h = home(slots[i].start);
+                // move the entry into the hole unless its home lies cyclically in (hole, i]
+                if (((i - h) & (capacity - 1)) >= ((i - hole) & (capacity - 1))) {
+                    slots[hole] = slots[i];
+                    hole = i;
+                }
+            }
+            slots[hole].start = nullptr;
+            count--;
+        }
+
+        template<typename F>
+        void forEach(F f) const {
+            for (size_t i = 0; i < capacity; i++) {
+                if (slots[i].start != nullptr) {
+                    f(slots[i]);
+                }
+            }
+        }
+    };
+
+    mutable std::mutex lock;
+    SpanTable live;
+    Span cache[MAX_CACHED_SPANS]; // oldest first
+    size_t cachedSpans = 0;
+    size_t cachedBytes = 0;
+    size_t maxCachedBytes = DEFAULT_MAX_CACHED_BYTES;
+    AllocatorStats counters; // pages and bytesMapped are counted by stats, slowPathHits are maps and unmaps
+
+private:
+    static inline size_t roundToPages(size_t size) {
+        size_t mask = systemPageSize() - 1;
+        return std::max((size + mask) & ~mask, mask + 1);
+    }
+
+    static inline size_t roundTo(size_t size, size_t granularity) {
+        return (size + granularity - 1) & ~(granularity - 1);
+    }
+
+    // a MAP_HUGETLB mapping can not be split off a huge page boundary, mapPages may have made one of such a request
+    static inline size_t granularityOf(size_t size, size_t alignment) {
+        bool huge = pageOptions().hugeTLB && size % HUGE_PAGE_SIZE == 0 && alignment % HUGE_PAGE_SIZE == 0;
+        return huge ? HUGE_PAGE_SIZE : systemPageSize();
+    }
+
+    void onAlloc(size_t size) {
+        counters.allocs++;
+        counters.bytesLive += size;
+        counters.peakBytesLive = std::max(counters.peakBytesLive, counters.bytesLive);
+    }
+
+    void removeCached(size_t i) {
+        cachedBytes -= cache[i].size;
+        std::copy(cache + i + 1, cache + cachedSpans, cache + i);
+        cachedSpans--;
+    }
+
+    /*
+     * Smallest cached span of at least size bytes with a start aligned to alignment, start is nullptr if none.
+     * A span more than a quarter bigger than size, rounded to its granularity, is split and its tail stays
+     * in the cache (on Windows it is not taken, a reservation can be released only as a whole).
+     */
+    Span takeCached(size_t size, size_t alignment) {
+        size_t best = cachedSpans;
+        for (size_t i = 0; i < cachedSpans; i++) {
+            if (cache[i].size >= size && reinterpret_cast<uintptr_t>(cache[i].start) % alignment == 0 &&
+                (best == cachedSpans || cache[i].size < cache[best].size)) {
+                best = i;
+            }
+        }
+        if (best == cachedSpans) {
+            return Span{nullptr, 0, 0};
+        }
+        Span &span = cache[best];
+        size = roundTo(size, span.granularity);
+        if (span.size - size > size / 4) {
+#ifdef WINDOWS
+            return Span{nullptr, 0, 0};
+#else
+            Span head{span.start, size, span.granularity};
+            span.start += size;
+            span.size -= size;
+            cachedBytes -= size;
+            return head;
+#endif
+        }
+        Span whole = span;
+        removeCached(best);
+        return whole;
+    }
+
+    // spans which do not fit into the cache any more are put to evicted, they are unmapped out of the lock
+    void putCached(Span span, Span *evicted, size_t &evictedCount) {
+#ifndef WINDOWS
+        // a split span grows back when its parts meet in the cache again
+        for (size_t i = 0; i < cachedSpans; i++) {
+            if (cache[i].granularity != span.granularity) {
+                continue; // mappings of different page sizes never become one span
+            }
+            if (cache[i].start + cache[i].size == span.start || span.start + span.size == cache[i].start) {
+                span.start = std::min(span.start, cache[i].start);
+                span.size += cache[i].size;
+                removeCached(i);
+                i = (size_t) -1; // a neighbour on the other side may be cached too
+            }
+        }
+#endif
+        if (span.size > maxCachedBytes) {
+            evicted[evictedCount++] = span;
+            return;
+        }
+        while (cachedSpans == MAX_CACHED_SPANS || cachedBytes + span.size > maxCachedBytes) {
+            evicted[evictedCount++] = cache[0];
+            removeCached(0);
+        }
+        cache[cachedSpans++] = span;
+        cachedBytes += span.size;
+    }
+
+    void unmap(const Span &span) {
+        freePage(span.start, span.size);
+    }
+
+public:
+    ~PageAllocator() {
+        assert(cachedSpans == 0);
+    }
+
+    // freed spans over this many bytes are returned to the OS, the oldest first
+    void setMaxCachedBytes(size_t bytes) {
+        Span evicted[MAX_CACHED_SPANS];
+        size_t evictedCount = 0;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            maxCachedBytes = bytes;
+            while (cachedBytes > maxCachedBytes) {
+                evicted[evictedCount++] = cache[0];
+                removeCached(0);
+            }
+            counters.slowPathHits += evictedCount;
+        }
+        for (size_t i = 0; i < evictedCount; i++) {
+            unmap(evicted[i]);
+        }
+    }
+
+    size_t cachedSpansCount() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return cachedSpans;
+    }
+
+    void init() override {
+        live.init();
+    }
+
+    // unmaps cached spans and spans which were not freed
+    void destroy() override {
+        for (size_t i = 0; i < cachedSpans; i++) {
+            unmap(cache[i]);
+        }
+        live.forEach([this](const Span &span) {
+            unmap(span);
+        });
+        live.destroy();
+        cachedSpans = cachedBytes = 0;
+        counters = AllocatorStats();
+    }
 
     void *alloc(size_t size) override {
-        size = size + sizeof(size_t);
-        size_t *p = allocPage<size_t>(size);
-        p[0] = size;
-        return p + 1;
+        return allocAligned(size, systemPageSize());
+    }
+
+    // blocks are page aligned anyway, bigger alignments are served by aligned mappings
+    void *allocAligned(size_t size, size_t alignment) override {
+        assert(alignment && !(alignment & (alignment - 1)));
+        alignment = std::max(alignment, systemPageSize());
+        size = roundToPages(size);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            Span span = takeCached(size, alignment);
+            if (span.start != nullptr) {
+                live.insert(span);
+                onAlloc(span.size);
+                return span.start;
+            }
+        }
+        byte *start = allocAlignedPage<byte>(size, alignment);
+        if (start == nullptr) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        live.insert(Span{start, size, granularityOf(size, alignment)});
+        onAlloc(size);
+        counters.slowPathHits++;
+        return start;
     }
 
     void free(void *p) override {
-        size_t *sp = reinterpret_cast<size_t *>(p) - 1;
-        freePage(sp, *sp);
+        if (p == nullptr) {
+            return; // an empty slot of the span table would match it
+        }
+        Span evicted[MAX_CACHED_SPANS + 1];
+        size_t evictedCount = 0;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            Span span = live.find(p);
+            live.erase(p);
+            counters.frees++;
+            counters.bytesLive -= span.size;
+            putCached(span, evicted, evictedCount);
+            counters.slowPathHits += evictedCount;
+        }
+        for (size_t i = 0; i < evictedCount; i++) {
+            unmap(evicted[i]);
+        }
+    }
+
+    size_t usableSize(void *p) const override {
+        std::lock_guard<std::mutex> guard(lock);
+        return live.find(p).size;
+    }
+
+    bool tryExpandInPlace(void *p, size_t size) override {
+        std::unique_lock<std::mutex> guard(lock);
+        size_t oldSize = live.find(p).size;
+        size = roundTo(roundToPages(size), live.find(p).granularity);
+        if (size == oldSize) {
+            return true;
+        }
+#ifdef __linux__
+        guard.unlock(); // the span is owned by the caller, nobody else changes it meanwhile
+        if (mremap(p, oldSize, size, 0) == MAP_FAILED) {
+            return false;
+        }
+        guard.lock();
+        live.find(p).size = size;
+        counters.bytesLive += size - oldSize;
+        counters.peakBytesLive = std::max(counters.peakBytesLive, counters.bytesLive);
+        return true;
+#else
+        return size <= oldSize;
+#endif
+    }
+
+    // a moved block keeps its alignment up to the system page size
+    void *realloc(void *p, size_t size) override {
+#ifdef __linux__
+        if (p == nullptr) {
+            return alloc(size);
+        }
+        // the kernel moves the pages instead of copying them, it can not when the span was merged
+        // from two mappings, then the block is copied
+        size_t oldSize;
+        size_t granularity;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            oldSize = live.find(p).size;
+            granularity = live.find(p).granularity;
+        }
+        size = roundTo(roundToPages(size), granularity);
+        void *moved = mremap(p, oldSize, size, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED) {
+            return AbstractAllocator::realloc(p, size);
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        live.erase(p);
+        live.insert(Span{toByte(moved), size, granularity});
+        counters.bytesLive += size - oldSize;
+        counters.peakBytesLive = std::max(counters.peakBytesLive, counters.bytesLive);
+        return moved;
+#else
+        return AbstractAllocator::realloc(p, size);
+#endif
+    }
+
+    // cached spans count as mapped pages
+    AllocatorStats stats() const override {
+        std::lock_guard<std::mutex> guard(lock);
+        AllocatorStats snapshot = counters;
+        snapshot.pages = live.size() + cachedSpans;
+        snapshot.bytesMapped = counters.bytesLive + cachedBytes;
+        return snapshot;
     }
 
 #ifdef DEBUG
     void dumpStat() const override {
-
+        AllocatorStats snapshot = stats();
+        std::cout << "Memory consumed: " << snapshot.bytesLive << " / " << snapshot.bytesMapped << std::endl;
+        std::cout << "Cached spans: " << cachedSpansCount() << std::endl;
     }
 
     void dumpBlock() const override {
-
+        std::lock_guard<std::mutex> guard(lock);
+        live.forEach([](const Span &span) {
+            std::cout << (void *) span.start << ' ' << span.size << std::endl;
+        });
     }
 #endif
 
@@ -0,0 +1,113 @@
+//
+// Created by ko on 21.12.2020.
+//
+
+#ifndef ALLOCATOR_PAGEMAP_H
+#define ALLOCATOR_PAGEMAP_H
+
+#include "AbstractAllocator.h"
+#include "NativePageAllocator.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+
+/*
+ * Two level radix tree from REGION_SIZE aligned address regions to the allocator owning them.
+ * Pages registered here must be aligned to REGION_SIZE and must not share a region with another owner.
+ * Lookups are wait free, so free can find the owner of a pointer without taking any lock.
+ */
+class PageMap {
+public:
+    static const size_t REGION_SHIFT = 23;
+    static const size_t REGION_SIZE = (size_t) 1 << REGION_SHIFT;
+
+private:
+    static const size_t ADDRESS_BITS = sizeof(void *) == 8 ? 48 : 32;
+    static const size_t KEY_BITS = ADDRESS_BITS - REGION_SHIFT;
+    static const size_t LEAF_BITS = KEY_BITS / 2 + KEY_BITS % 2;
+    static const size_t ROOT_BITS = KEY_BITS - LEAF_BITS;
+    static const size_t LEAF_LENGTH = (size_t) 1 << LEAF_BITS;
+    static const size_t ROOT_LENGTH = (size_t) 1 << ROOT_BITS;
+
+    struct Leaf {
+        std::atomic<AbstractAllocator *> owners[LEAF_LENGTH];
+    };
+
+    std::atomic<Leaf *> *root = nullptr;
+
+private:
+    static inline size_t key(const void *p) {
+        uintptr_t address = reinterpret_cast<uintptr_t>(p);
+        assert((address >> ADDRESS_BITS) == 0 || sizeof(void *) != 8);
+        return address >> REGION_SHIFT;
+    }
+
+    Leaf *leaf(size_t k) {
+        std::atomic<Leaf *> &slot = root[k >> LEAF_BITS];
+        Leaf *l = slot.load(std::memory_order_acquire);
+        if (l != nullptr) {
+            return l;
+        }
+        Leaf *created = allocPage<Leaf>(sizeof(Leaf));
+        for (size_t i = 0; i < LEAF_LENGTH; i++) {
+            created->owners[i].store(nullptr, std::memory_order_relaxed);
+        }
+        if (slot.compare_exchange_strong(l, created, std::memory_order_acq_rel)) {
+            return created;
+        }
+        freePage(created, sizeof(Leaf)); // another thread created the same leaf first
+        return l;
+    }
+
+    void assign(const void *page, size_t size, AbstractAllocator *owner) {
+        assert(root != nullptr);
+        assert(reinterpret_cast<uintptr_t>(page) % REGION_SIZE == 0);
+        size_t first = key(page), last = key(toByte(const_cast<void *>(page)) + size - 1);
+        for (size_t k = first; k <= last; k++) {
+            leaf(k)->owners[k & (LEAF_LENGTH - 1)].store(owner, std::memory_order_release);
+        }
+    }
+
+public:
+    ~PageMap() {
+        assert(root == nullptr);
+    }
+
+    void init() {
+        assert(root == nullptr);
+        root = allocPage<std::atomic<Leaf *>>(ROOT_LENGTH * sizeof(std::atomic<Leaf *>));
+        for (size_t i = 0; i < ROOT_LENGTH; i++) {
+            root[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    void destroy() {
+        assert(root != nullptr);
+        for (size_t i = 0; i < ROOT_LENGTH; i++) {
+            Leaf *l = root[i].load(std::memory_order_relaxed);
+            if (l != nullptr) {
+                freePage(l, sizeof(Leaf));
+            }
+        }
+        freePage(root, ROOT_LENGTH * sizeof(std::atomic<Leaf *>));
+        root = nullptr;
+    }
+
+    void insert(const void *page, size_t size, AbstractAllocator *owner) {
+        assign(page, size, owner);
+    }
+
+    void erase(const void *page, size_t size) {
+        assign(page, size, nullptr);
+    }
+
+    // owner of the region p lies in or nullptr if the region was never registered
+    inline AbstractAllocator *find(const void *p) const {
+        size_t k = key(p);
+        Leaf *l = root[k >> LEAF_BITS].load(std::memory_order_acquire);
+        return l == nullptr ? nullptr : l->owners[k & (LEAF_LENGTH - 1)].load(std::memory_order_acquire);
+    }
+};
+
+#endif //ALLOCATOR_PAGEMAP_H
@@ -0,0 +1,129 @@
+//
+// Created by ko on 23.12.2020.
+//
+
+#ifndef ALLOCATOR_STLALLOCATOR_H
+#define ALLOCATOR_STLALLOCATOR_H
+
+#include "AbstractAllocator.h"
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define ALLOCATOR_HAS_PMR
+#endif
+#endif
+
+/*
+ * Allocator of standard containers over an AbstractAllocator. Does not own it: the allocator
+ * must be initialized before the container allocates and destroyed after the container is gone.
+ * Rebound copies share the same AbstractAllocator, so a FixedSizeAllocator may serve
+ * node based containers which allocate one node at a time.
+ */
+template<typename T>
+class StlAllocator {
+    template<typename U>
+    friend class StlAllocator;
+
+    AbstractAllocator *allocator;
+
+public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    template<typename U>
+    struct rebind {
+        typedef StlAllocator<U> other;
+    };
+
+    explicit StlAllocator(AbstractAllocator &allocator) : allocator(&allocator) {}
+
+    template<typename U>
+    StlAllocator(const StlAllocator<U> &other) : allocator(other.allocator) {}
+
+    T *allocate(size_t n) {
+        if (n > allocator->maxAllocSize() / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        // every allocator aligns blocks at least to a pointer, stricter alignments are requested explicitly
+        void *p = alignof(T) <= sizeof(void *) ? allocator->alloc(n * sizeof(T))
+                                                : allocator->allocAligned(n * sizeof(T), alignof(T));
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, size_t) {
+        allocator->free(p);
+    }
+
+    size_t max_size() const {
+        return allocator->maxAllocSize() / sizeof(T);
+    }
+
+    AbstractAllocator &underlying() const {
+        return *allocator;
+    }
+
+    template<typename U>
+    bool operator==(const StlAllocator<U> &other) const {
+        return allocator == other.allocator;
+    }
+
+    template<typename U>
+    bool operator!=(const StlAllocator<U> &other) const {
+        return allocator != other.allocator;
+    }
+};
+
+#ifdef ALLOCATOR_HAS_PMR
+
+/*
+ * Polymorphic memory resource over an AbstractAllocator, available since C++17
+ */
+class AllocatorMemoryResource : public std::pmr::memory_resource {
+    AbstractAllocator *allocator;
+
+public:
+    explicit AllocatorMemoryResource(AbstractAllocator &allocator) : allocator(&allocator) {}
+
+    AbstractAllocator &underlying() const {
+        return *allocator;
+    }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        void *p = alignment <= sizeof(void *) ? allocator->alloc(bytes) : allocator->allocAligned(bytes, alignment);
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        allocator->free(p);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        const AllocatorMemoryResource *resource = dynamic_cast<const AllocatorMemoryResource *>(&other);
+        return resource != nullptr && resource->allocator == allocator;
+    }
+};
+
+#endif
+
+#endif //ALLOCATOR_STLALLOCATOR_H
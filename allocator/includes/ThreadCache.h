@@ -0,0 +1,139 @@
+//
+// Created by ko on 21.12.2020.
+//
+
+#ifndef ALLOCATOR_THREADCACHE_H
+#define ALLOCATOR_THREADCACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+
+// the slow path stays out of line, so the lookup is small enough to be inlined on every alloc and free
+#ifdef _MSC_VER
+#define THREAD_CACHE_NOINLINE __declspec(noinline)
+#else
+#define THREAD_CACHE_NOINLINE __attribute__((noinline))
+#endif
+
+/*
+ * Fixed capacity stack of free blocks of one size class owned by one thread.
+ * Refills and flushes move BATCH blocks at once, so the owning arena lock is taken
+ * once per BATCH operations instead of once per operation.
+ */
+struct Magazine {
+    static const size_t CAPACITY = 64;
+    static const size_t BATCH = CAPACITY / 2;
+
+    size_t count = 0;
+    void *blocks[CAPACITY];
+    // written only by the owning thread, atomic so stats snapshots may read them from other threads
+    std::atomic<size_t> allocs{0};
+    std::atomic<size_t> frees{0};
+
+    static inline void increment(std::atomic<size_t> &counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    inline bool isEmpty() const {
+        return count == 0;
+    }
+
+    inline bool isFull() const {
+        return count == CAPACITY;
+    }
+
+    inline void *pop() {
+        return blocks[--count];
+    }
+
+    inline void push(void *p) {
+        blocks[count++] = p;
+    }
+};
+
+/*
+ * Per thread, per owner set of magazines. Caches of one thread form a singly linked list,
+ * caches of one owner form a doubly linked registry list, so the owner can drain them on destroy
+ * and the thread can drain them on exit, whichever comes first.
+ */
+template<typename Owner, size_t CLASSES>
+struct ThreadCache {
+    Owner *owner;
+    size_t epoch;
+    ThreadCache *nextInThread = nullptr;
+    ThreadCache *prevInOwner = nullptr;
+    ThreadCache *nextInOwner = nullptr;
+    Magazine magazines[CLASSES];
+    size_t node = 0; // NUMA node which arenas refill the magazines, set by the owner
+#ifdef HARDENED
+    size_t sampleCountdown = 0; // allocations left up to the next one the owner samples, set by the owner
+#endif
+
+    ThreadCache(Owner *owner, size_t epoch) : owner(owner), epoch(epoch) {}
+
+    // guards owner registries and detaching, never taken on the alloc/free fast path
+    static std::mutex &registryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    class ThreadList {
+        ThreadCache *head = nullptr;
+
+    public:
+        ~ThreadList() {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            while (head != nullptr) {
+                ThreadCache *cache = head;
+                head = head->nextInThread;
+                if (cache->owner != nullptr) {
+                    cache->owner->releaseThreadCache(cache);
+                }
+                delete cache;
+            }
+        }
+
+        inline ThreadCache *find(const Owner *owner, size_t epoch) {
+            if (head != nullptr && head->owner == owner && head->epoch == epoch) {
+                return head;
+            }
+            return findSlow(owner, epoch);
+        }
+
+    private:
+        THREAD_CACHE_NOINLINE ThreadCache *findSlow(const Owner *owner, size_t epoch) {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            ThreadCache **link = &head;
+            ThreadCache *found = nullptr;
+            while (*link != nullptr) {
+                ThreadCache *cache = *link;
+                if (cache->owner == nullptr) { // owner was destroyed, magazines are already dropped
+                    *link = cache->nextInThread;
+                    delete cache;
+                    continue;
+                }
+                if (cache->owner == owner && cache->epoch == epoch) {
+                    *link = cache->nextInThread;
+                    found = cache;
+                    break;
+                }
+                link = &cache->nextInThread;
+            }
+            if (found == nullptr) {
+                found = new ThreadCache(const_cast<Owner *>(owner), epoch);
+                found->owner->registerThreadCache(found);
+            }
+            found->nextInThread = head; // move to front, so the next lookup is a single compare
+            head = found;
+            return found;
+        }
+    };
+
+    static ThreadList &threadList() {
+        static thread_local ThreadList list;
+        return list;
+    }
+};
+
+#endif //ALLOCATOR_THREADCACHE_H
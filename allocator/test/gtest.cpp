@@ -3,9 +3,21 @@
 #include "CoalesceAllocator.h"
 #include "MemoryAllocator.h"
 #include "PageAllocator.h"
+#include "ArenaAllocator.h"
+#include "ConcurrentFixedSizeAllocator.h"
+#include "StlAllocator.h"
+#include "Dictionary.h"
+#include "list.h"
+#include <map>
 #include <vector>
 #include <algorithm>
+#include <deque>
 #include <random>
+#include <sstream>
+#include <thread>
+#ifndef WINDOWS
+#include <sys/mman.h>
+#endif
 
 #ifdef DEBUF
 //#define COUT
@@ -178,6 +190,35 @@ void testRandomAllocations(AbstractAllocator &a, int iter) {
     a.destroy();
 }
 
+void testRealloc(AbstractAllocator &a) {
+    a.init();
+    size_t maxSize = std::min((size_t) 1 << 16, a.maxAllocSize() - 1);
+    std::vector<byte *> objs;
+    std::vector<size_t> sizes;
+    for (int i = 0; i < 100; i++) {
+        size_t size = 1 + rand() % std::min((size_t) 64, maxSize);
+        byte *v = static_cast<byte *>(a.alloc(size));
+        generateSeq(v, size, i);
+        objs.push_back(v);
+        sizes.push_back(size);
+    }
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < 100; i++) {
+            size_t size = 1 + rand() % maxSize;
+            size_t kept = std::min(size, sizes[i]);
+            objs[i] = static_cast<byte *>(a.realloc(objs[i], size));
+            checkSeq(objs[i], kept, i);
+            generateSeq(objs[i], size, i);
+            sizes[i] = size;
+        }
+    }
+    for (int i = 0; i < 100; i++) {
+        checkSeq(objs[i], sizes[i], i);
+        a.free(objs[i]);
+    }
+    a.destroy();
+}
+
 void testAll(AbstractAllocator &a) {
     testInitDestroy(a);
     testInitDestroy(a); // initialization after destroy
@@ -186,6 +227,7 @@ void testAll(AbstractAllocator &a) {
     testAllocLotsInt(a);
     testLotsOfMemory(a);
     testRandomAllocations(a, 20000);
+    testRealloc(a);
 }
 
 TEST(common_allocators_tests, test_fixed_sized) {
@@ -208,6 +250,882 @@ TEST(common_allocators_tests, test_mem_alloc) {
     testAll(a);
 }
 
+TEST(common_allocators_tests, test_arena) {
+    ArenaAllocator a;
+    testAll(a);
+}
+
+TEST(page_options_tests, test_lazy_commit_and_huge_pages) {
+    PageOptions old = pageOptions();
+    pageOptions().lazyCommit = true;
+    pageOptions().transparentHugePages = true;
+    pageOptions().hugeTLB = true; // falls back to normal pages when none are reserved
+    FixedSizeAllocator fsa(256);
+    testAll(fsa);
+    CoalesceAllocator ca;
+    testAll(ca);
+    pageOptions() = old;
+}
+
+#ifndef WINDOWS
+
+// a retained empty page is committed again from its header, the commits must stop at the end of the page
+TEST(page_options_tests, test_refill_decommitted_page_to_the_end) {
+    PageOptions old = pageOptions();
+    pageOptions().lazyCommit = true;
+    const size_t pageSize = 1 << 23, blockSize = 1 << 16;
+    FixedSizeAllocator a(blockSize);
+    a.init();
+    std::vector<byte *> first;
+    byte *page = nullptr;
+    while (true) { // fills the first page, the next block opens the second one
+        byte *v = static_cast<byte *>(a.alloc(blockSize));
+        byte *vPage = reinterpret_cast<byte *>(reinterpret_cast<uintptr_t>(v) & ~(uintptr_t) (pageSize - 1));
+        if (page != nullptr && vPage != page) {
+            a.free(v);
+            break;
+        }
+        page = vPage;
+        first.push_back(v);
+    }
+    // something PROT_NONE right behind the page, as a lazy page or a guard page of another allocator
+    void *guard = mmap(page + pageSize, systemPageSize(), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(guard, MAP_FAILED);
+    if (guard != page + pageSize) {
+        munmap(guard, systemPageSize());
+        a.destroy();
+        pageOptions() = old;
+        GTEST_SKIP() << "the address behind the page is taken";
+    }
+    for (byte *v : first) { // the page gets empty and is retained decommitted
+        a.free(v);
+    }
+    std::vector<byte *> second;
+    while (second.size() < first.size() * 2) { // up to the last block of the first page
+        byte *v = static_cast<byte *>(a.alloc(blockSize));
+        v[0] = v[blockSize - 1] = 1;
+        second.push_back(v);
+    }
+    ASSERT_NE(std::find(second.begin(), second.end(), *std::max_element(first.begin(), first.end())), second.end());
+    EXPECT_DEATH(*static_cast<volatile byte *>(guard) = 1, "");
+    for (byte *v : second) {
+        a.free(v);
+    }
+    a.destroy();
+    munmap(guard, systemPageSize());
+    pageOptions() = old;
+}
+
+#endif
+
+TEST(page_options_tests, test_coalesce_reuses_decommitted_pages) {
+    CoalesceAllocator a;
+    a.init();
+    const size_t size = 1 << 22;
+    for (int round = 0; round < 3; round++) {
+        std::vector<byte *> objs;
+        for (int i = 0; i < 12; i++) { // spans several pages
+            byte *v = static_cast<byte *>(a.alloc(size));
+            generateSeq(v, size, i);
+            objs.push_back(v);
+        }
+        for (int i = 0; i < 12; i++) {
+            checkSeq(objs[i], size, i);
+            a.free(objs[i]);
+        }
+    }
+    a.destroy();
+}
+
+template<typename Allocator>
+void testReleaseEmptyPages(Allocator &a, size_t size, int count, size_t retained) {
+    a.setMaxRetainedEmptyPages(retained);
+    a.init();
+    for (int round = 0; round < 2; round++) {
+        std::vector<byte *> objs;
+        for (int i = 0; i < count; i++) {
+            byte *v = static_cast<byte *>(a.alloc(size));
+            v[0] = static_cast<byte>(i);
+            objs.push_back(v);
+        }
+        ASSERT_GT(a.pagesCount(), retained + 1);
+        for (int i = 0; i < count; i++) {
+            ASSERT_EQ(objs[i][0], static_cast<byte>(i));
+            a.free(objs[i]);
+        }
+        ASSERT_LE(a.pagesCount(), retained + 1);
+    }
+    a.destroy();
+}
+
+TEST(stats_tests, test_counters) {
+    FixedSizeAllocator fsa(64);
+    fsa.init();
+    void *v = fsa.alloc(64), *u = fsa.alloc(10);
+    AllocatorStats stats = fsa.stats();
+    ASSERT_EQ(stats.allocs, 2u);
+    ASSERT_EQ(stats.bytesLive, 128u);
+    ASSERT_EQ(stats.pages, 1u);
+    fsa.free(v);
+    fsa.free(u);
+    stats = fsa.stats();
+    ASSERT_EQ(stats.frees, 2u);
+    ASSERT_EQ(stats.bytesLive, 0u);
+    ASSERT_EQ(stats.peakBytesLive, 128u);
+    fsa.destroy();
+
+    CoalesceAllocator ca;
+    ca.init();
+    v = ca.alloc(1000);
+    stats = ca.stats();
+    ASSERT_GE(stats.bytesLive, 1000u);
+    ASSERT_GT(stats.fragmentation(), 0.9);
+    ca.free(v);
+    ASSERT_EQ(ca.stats().bytesLive, 0u);
+    ca.destroy();
+}
+
+TEST(stats_tests, test_mem_alloc_snapshot) {
+    MemoryAllocator a;
+    a.init();
+    std::vector<void *> objs;
+    for (int i = 0; i < 100; i++) {
+        objs.push_back(a.alloc(20));
+    }
+    objs.push_back(a.alloc(1000));
+    objs.push_back(a.alloc((size_t) 1 << 25));
+    std::thread([&a]() { a.free(a.alloc(20)); }).join();
+
+    MemoryAllocatorStats snapshot = a.detailedStats();
+    ASSERT_EQ(snapshot.sizeClasses[1].blockSize, 32u);
+    ASSERT_EQ(snapshot.sizeClasses[1].allocs, 101u);
+    ASSERT_EQ(snapshot.sizeClasses[1].frees, 1u);
+    ASSERT_EQ(snapshot.sizeClasses[1].bytesLive, 100u * 32);
+    ASSERT_EQ(snapshot.coalesce.allocs, 1u);
+    ASSERT_EQ(snapshot.page.allocs, 1u);
+    ASSERT_EQ(snapshot.total.allocs, 103u);
+    for (void *p : objs) {
+        a.free(p);
+    }
+    ASSERT_EQ(a.stats().bytesLive, 0u);
+    a.destroy();
+}
+
+TEST(realloc_tests, test_coalesce_expand_in_place) {
+    CoalesceAllocator a;
+    a.init();
+    byte *v = static_cast<byte *>(a.alloc(100));
+    byte *guard = static_cast<byte *>(a.alloc(100));
+    byte *w = static_cast<byte *>(a.alloc(100));
+    a.free(guard);
+    ASSERT_TRUE(a.tryExpandInPlace(v, 200)); // grows into the freed neighbour
+    ASSERT_GE(a.usableSize(v), 200u);
+    ASSERT_FALSE(a.tryExpandInPlace(v, 1000)); // w is in the way
+    ASSERT_TRUE(a.tryExpandInPlace(w, 1000)); // the rest of the page is free
+    ASSERT_TRUE(a.tryExpandInPlace(w, 10)); // shrinks
+    ASSERT_TRUE(a.tryExpandInPlace(v, 40));
+    a.free(v);
+    a.free(w);
+    a.destroy();
+}
+
+TEST(realloc_tests, test_page_realloc) {
+    PageAllocator a;
+    a.init();
+    byte *v = static_cast<byte *>(a.alloc(1 << 20));
+    generateSeq(v, 1 << 20, 3);
+    v = static_cast<byte *>(a.realloc(v, 1 << 24));
+    checkSeq(v, 1 << 20, 3);
+    ASSERT_GE(a.usableSize(v), (size_t) 1 << 24);
+    a.free(v);
+    a.destroy();
+}
+
+TEST(page_cache_tests, test_page_rounding) {
+    PageAllocator a;
+    a.init();
+    byte *v = static_cast<byte *>(a.alloc(1));
+    byte *w = static_cast<byte *>(a.alloc(systemPageSize() + 1));
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(v) % systemPageSize(), 0u); // no header before the block
+    ASSERT_EQ(a.usableSize(v), systemPageSize());
+    ASSERT_EQ(a.usableSize(w), 2 * systemPageSize());
+    a.free(v);
+    a.free(w);
+    a.destroy();
+}
+
+TEST(page_cache_tests, test_free_null) {
+    PageAllocator a;
+    a.init();
+    void *v = a.alloc(1);
+    a.free(nullptr);
+    AllocatorStats snapshot = a.stats();
+    ASSERT_EQ(snapshot.frees, 0u);
+    ASSERT_EQ(snapshot.bytesLive, systemPageSize());
+    ASSERT_EQ(a.cachedSpansCount(), 0u);
+    a.free(v);
+    ASSERT_EQ(a.stats().bytesLive, 0u);
+
+    MemoryAllocator m;
+    m.init();
+    m.free(nullptr); // not in the page map, so it goes to the page allocator
+    ASSERT_EQ(m.stats().frees, 0u);
+    m.destroy();
+    a.destroy();
+}
+
+TEST(page_cache_tests, test_buffer_churn_reuses_spans) {
+    PageAllocator a;
+    a.init();
+    std::mt19937 rng(7);
+    const int rounds = 200;
+    std::deque<byte *> objs;
+    for (int i = 0; i < rounds; i++) {
+        size_t size = ((size_t) 1 << 24) + rng() % ((size_t) 3 << 24); // 16..64MB
+        byte *v = static_cast<byte *>(a.alloc(size));
+        v[0] = 1;
+        v[size - 1] = 2;
+        objs.push_back(v);
+        if (objs.size() > 2) {
+            a.free(objs.front());
+            objs.pop_front();
+        }
+    }
+    AllocatorStats snapshot = a.stats();
+    ASSERT_EQ(snapshot.allocs, (size_t) rounds);
+    ASSERT_LT(snapshot.slowPathHits, (size_t) rounds / 4); // maps and unmaps
+    ASSERT_LE(snapshot.bytesMapped - snapshot.bytesLive, (size_t) PageAllocator::DEFAULT_MAX_CACHED_BYTES);
+    for (byte *v : objs) {
+        a.free(v);
+    }
+    a.destroy();
+}
+
+TEST(page_cache_tests, test_split_and_merge) {
+    PageAllocator a;
+    a.init();
+    const size_t size = (size_t) 1 << 22;
+    void *whole = a.alloc(4 * size);
+    a.free(whole);
+    ASSERT_EQ(a.stats().slowPathHits, 1u);
+    void *head = a.alloc(size); // the cached span is split
+    void *tail = a.alloc(3 * size); // and its tail is taken whole
+    ASSERT_EQ(head, whole);
+    ASSERT_EQ(toByte(tail), toByte(whole) + size);
+    ASSERT_EQ(a.cachedSpansCount(), 0u);
+    a.free(tail);
+    a.free(head);
+    ASSERT_EQ(a.cachedSpansCount(), 1u); // merged back
+    ASSERT_EQ(a.alloc(4 * size), whole);
+    ASSERT_EQ(a.stats().slowPathHits, 1u);
+    a.free(whole);
+
+    a.setMaxCachedBytes(0); // unmaps the cached span
+    a.free(a.alloc(size));
+    ASSERT_EQ(a.cachedSpansCount(), 0u);
+    ASSERT_EQ(a.stats().slowPathHits, 4u);
+    a.destroy();
+}
+
+TEST(page_cache_tests, test_huge_spans_split_at_huge_pages) {
+    PageOptions old = pageOptions();
+    pageOptions().hugeTLB = true; // falls back to normal pages when none are reserved
+    PageAllocator a;
+    a.init();
+    const size_t huge = HUGE_PAGE_SIZE;
+    void *whole = a.allocAligned(4 * huge, huge);
+    a.free(whole);
+    pageOptions() = old;
+    void *head = a.alloc(1); // a part of a MAP_HUGETLB span can be unmapped only at huge pages
+    ASSERT_EQ(head, whole);
+    ASSERT_EQ(a.usableSize(head), huge);
+    void *tail = a.alloc(systemPageSize());
+    ASSERT_EQ(toByte(tail), toByte(whole) + huge);
+    ASSERT_EQ(a.usableSize(tail), huge);
+    ASSERT_EQ(a.cachedSpansCount(), 1u);
+    a.free(tail);
+    a.free(head);
+    ASSERT_EQ(a.cachedSpansCount(), 1u); // merged back
+    ASSERT_EQ(a.alloc(4 * huge), whole);
+    ASSERT_EQ(a.stats().slowPathHits, 1u);
+    a.free(whole);
+    a.destroy();
+}
+
+void testAllocAligned(AbstractAllocator &a, const std::vector<size_t> &sizes, const std::vector<size_t> &alignments) {
+    a.init();
+    std::vector<byte *> objs;
+    std::vector<size_t> objSizes;
+    for (size_t size : sizes) {
+        for (size_t alignment : alignments) {
+            byte *v = static_cast<byte *>(a.allocAligned(size, alignment));
+            ASSERT_EQ(reinterpret_cast<uintptr_t>(v) % alignment, 0u);
+            ASSERT_GE(a.usableSize(v), size);
+            generateSeq(v, size, objs.size());
+            objs.push_back(v);
+            objSizes.push_back(size);
+        }
+    }
+    for (size_t i = 0; i < objs.size(); i++) {
+        checkSeq(objs[i], objSizes[i], i);
+        a.free(objs[i]);
+    }
+    a.destroy();
+}
+
+TEST(aligned_alloc_tests, test_fixed_sized) {
+    FixedSizeAllocator a(192);
+    ASSERT_EQ(a.blockAlignment(), 64u);
+    testAllocAligned(a, {1, 100, 192}, {8, 16, 64});
+}
+
+TEST(aligned_alloc_tests, test_coalesce) {
+    CoalesceAllocator a;
+    testAllocAligned(a, {1, 17, 100, 1000, 100000}, {8, 16, 32, 64, 4096, 1 << 16});
+    a.init();
+    std::vector<void *> objs;
+    for (int i = 0; i < 1000; i++) { // plain blocks of any size are aligned as well
+        objs.push_back(a.alloc(rand() % 1000));
+        ASSERT_EQ(reinterpret_cast<uintptr_t>(objs.back()) % CoalesceAllocator::ALIGNMENT, 0u);
+    }
+    for (void *p : objs) {
+        a.free(p);
+    }
+    a.destroy();
+}
+
+TEST(aligned_alloc_tests, test_page) {
+    PageAllocator a;
+    testAllocAligned(a, {1, 100000, 1 << 22}, {16, 64, 4096, 1 << 21});
+}
+
+TEST(aligned_alloc_tests, test_mem_alloc) {
+    MemoryAllocator a;
+    testAllocAligned(a, {1, 24, 64, 100, 500, 1000, 100000, (size_t) 1 << 25}, {8, 16, 32, 64, 256, 4096});
+    a.init();
+    void *line = a.allocAligned(64, 64); // takes the 64 bytes class, not a bigger block
+    ASSERT_EQ(a.usableSize(line), 64u);
+    a.free(line);
+    a.destroy();
+}
+
+TEST(aligned_alloc_tests, test_arena) {
+    ArenaAllocator a(1 << 16);
+    testAllocAligned(a, {1, 100, 1000, 100000}, {8, 16, 64, 4096});
+}
+
+TEST(arena_tests, test_reset_reuses_pages) {
+    ArenaAllocator a(1 << 16);
+    a.init();
+    byte *first = nullptr;
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 10000; i++) {
+            byte *v = static_cast<byte *>(a.alloc(40));
+            if (i == 0 && round == 0) first = v;
+            if (i == 0) {
+                ASSERT_EQ(v, first);
+            }
+            v[39] = 1;
+        }
+        ASSERT_EQ(a.stats().bytesLive, 10000u * 48);
+        size_t pages = a.pagesCount();
+        a.reset();
+        ASSERT_EQ(a.stats().bytesLive, 0u);
+        ASSERT_EQ(a.pagesCount(), pages); // nothing is returned to the OS
+    }
+    a.destroy();
+}
+
+TEST(arena_tests, test_nested_checkpoints) {
+    ArenaAllocator a(1 << 12);
+    a.init();
+    byte *outer = static_cast<byte *>(a.alloc(100));
+    byte *next;
+    {
+        ArenaAllocator::Scope request(a);
+        next = static_cast<byte *>(a.alloc(100));
+        {
+            ArenaAllocator::Scope nested(a);
+            for (int i = 0; i < 1000; i++) { // spills over several pages
+                a.alloc(100);
+            }
+        }
+        ASSERT_EQ(a.alloc(100), next + 112);
+        ArenaAllocator::Checkpoint checkpoint = a.checkpoint();
+        a.alloc(1 << 20); // larger than a page
+        a.rollback(checkpoint);
+        ASSERT_EQ(a.alloc(100), next + 224);
+    }
+    ASSERT_EQ(a.alloc(100), next);
+    ASSERT_EQ(a.stats().bytesLive, 2u * 112);
+    ASSERT_EQ(outer + 112, next);
+    a.destroy();
+}
+
+TEST(arena_tests, test_expand_last_block) {
+    ArenaAllocator a;
+    a.init();
+    byte *v = static_cast<byte *>(a.alloc(100));
+    generateSeq(v, 100, 1);
+    ASSERT_TRUE(a.tryExpandInPlace(v, 1000));
+    byte *w = static_cast<byte *>(a.alloc(10));
+    ASSERT_FALSE(a.tryExpandInPlace(v, 2000)); // v is not the last block any more
+    byte *moved = static_cast<byte *>(a.realloc(v, 2000));
+    ASSERT_NE(moved, v);
+    checkSeq(moved, 100, 1);
+    ASSERT_TRUE(a.tryExpandInPlace(moved, 4000));
+    a.free(w);
+    a.destroy();
+}
+
+TEST(bulk_tests, test_fixed_sized_bulk) {
+    FixedSizeAllocator a(256);
+    a.setMaxRetainedEmptyPages(0);
+    a.init();
+    const size_t n = 100000; // spans several pages
+    std::vector<void *> objs(n);
+    a.allocBulk(n, objs.data());
+    for (size_t i = 0; i < n; i++) {
+        static_cast<size_t *>(objs[i])[31] = i;
+    }
+    std::vector<void *> sorted = objs;
+    std::sort(sorted.begin(), sorted.end());
+    ASSERT_TRUE(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+    ASSERT_EQ(a.stats().allocs, n);
+    size_t pages = a.pagesCount();
+
+    std::mt19937 g(0x241251);
+    std::shuffle(objs.begin(), objs.end(), g);
+    a.freeBulk(objs.data(), n / 2);
+    a.allocBulk(n / 2, objs.data()); // takes the freed blocks back
+    ASSERT_EQ(a.pagesCount(), pages);
+    for (size_t i = n / 2; i < n; i++) {
+        ASSERT_LT(static_cast<size_t *>(objs[i])[31], n); // blocks which were not freed keep their content
+    }
+    std::sort(objs.begin(), objs.end()); // long runs of one page
+    a.freeBulk(objs.data(), n);
+    ASSERT_EQ(a.stats().bytesLive, 0u);
+    ASSERT_EQ(a.pagesCount(), 1u);
+    a.destroy();
+}
+
+#ifdef HARDENED
+
+TEST(hardened_tests, test_fixed_sized_double_free) {
+    FixedSizeAllocator a(64);
+    a.init();
+    void *p = a.alloc(64);
+    void *q = a.alloc(64);
+    a.free(p);
+    EXPECT_DEATH(a.free(p), "double free");
+    EXPECT_DEATH(a.free(toByte(q) + 8), "not a block");
+    a.free(q);
+    a.destroy();
+}
+
+TEST(hardened_tests, test_fixed_sized_random_order) {
+    std::vector<void *> orders[2];
+    for (std::vector<void *> &order : orders) {
+        FixedSizeAllocator a(64);
+        a.init();
+        byte *first = toByte(a.alloc(64));
+        for (int i = 0; i < 100; i++) {
+            order.push_back(reinterpret_cast<void *>(toByte(a.alloc(64)) - first));
+        }
+        a.destroy(); // the pages go back as a whole, hardened mode does not need every block freed
+    }
+    ASSERT_NE(orders[0], orders[1]);
+}
+
+TEST(hardened_tests, test_coalesce_double_free) {
+    CoalesceAllocator a;
+    a.init();
+    void *p = a.alloc(100);
+    void *q = a.alloc(100);
+    a.free(q); // merged into the free rest of the page
+    EXPECT_DEATH(a.free(q), "double free");
+    a.free(p);
+    EXPECT_DEATH(a.free(p), "double free");
+    a.destroy();
+}
+
+TEST(hardened_tests, test_mem_alloc_double_free) {
+    MemoryAllocator a;
+    a.init();
+    void *p = a.alloc(32);
+    void *q = a.alloc(32);
+    a.free(p); // stays in the magazine of this thread
+    a.free(q);
+    // a block freed twice is caught before it is handed out twice
+    EXPECT_DEATH({ a.free(q); a.alloc(32); a.alloc(32); }, "double free");
+    EXPECT_DEATH({ a.free(p); a.alloc(32); a.alloc(32); a.alloc(32); }, "double free"); // not the last block freed
+    EXPECT_DEATH({ std::thread([&]() { a.free(p); a.alloc(32); }).join(); a.alloc(32); a.alloc(32); }, "double free");
+    EXPECT_DEATH({ *static_cast<volatile uintptr_t *>(q) = 1; a.alloc(32); }, "write to a freed block");
+
+    // a flushed block is back in the free list of its page, the magazine keeps the first blocks freed
+    std::vector<void *> objs;
+    for (size_t i = 0; i < 4 * Magazine::CAPACITY; i++) {
+        objs.push_back(a.alloc(32));
+    }
+    for (void *v : objs) {
+        a.free(v);
+    }
+    EXPECT_DEATH(a.free(objs[Magazine::BATCH]), "double free"); // flushed with the upper half of the full magazine
+    a.destroy();
+}
+
+TEST(hardened_tests, test_mem_alloc_guarded_sample) {
+    HardeningOptions old = hardeningOptions();
+    hardeningOptions().guardedSampleRate = 1;
+    MemoryAllocator a;
+    a.init();
+    std::vector<byte *> objs;
+    std::thread([&]() { // sampling countdowns are per thread, a new one starts with the new rate
+        for (int i = 0; i < 8; i++) {
+            objs.push_back(static_cast<byte *>(a.alloc(48)));
+        }
+    }).join();
+    hardeningOptions() = old;
+    // with the rate of one at least every second allocation after the first one is sampled
+    size_t pageSize = systemPageSize();
+    size_t guardedCount = 0;
+    for (byte *p : objs) {
+        generateSeq(p, 48, 0);
+        if ((reinterpret_cast<uintptr_t>(p) + 48) % pageSize == 0) {
+            guardedCount++;
+            volatile byte *guarded = p;
+            EXPECT_DEATH(guarded[48] = 1, ""); // overflow into the guard page
+        }
+    }
+    ASSERT_GE(guardedCount, 3u);
+    for (byte *p : objs) {
+        checkSeq(p, 48, 0);
+        bool isGuarded = (reinterpret_cast<uintptr_t>(p) + 48) % pageSize == 0;
+        a.free(p);
+        if (isGuarded) {
+            volatile byte *freed = p;
+            EXPECT_DEATH(freed[0] = 1, ""); // use after free
+            EXPECT_DEATH(a.free(p), "double free");
+        }
+    }
+    a.destroy();
+}
+
+#endif
+
+TEST(heap_profiler_tests, test_profile_of_every_allocation) {
+    MemoryAllocator a;
+    a.init();
+    a.heapProfiler().setSampleRate(1); // blocks of 100 bytes are sampled with probability 1 - e^-100
+    std::vector<void *> objs;
+    for (int i = 0; i < 10; i++) {
+        objs.push_back(a.alloc(100));
+    }
+    for (int i = 0; i < 4; i++) {
+        a.free(objs[i]);
+    }
+    ASSERT_EQ(a.heapProfiler().liveSamples(), 6u);
+    std::stringstream profile;
+    a.heapProfiler().writeProfile(profile);
+    size_t inuseCount, inuseBytes, allocCount, allocBytes, rate;
+    ASSERT_EQ(sscanf(profile.str().c_str(), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu", &inuseCount,
+                     &inuseBytes, &allocCount, &allocBytes, &rate), 5);
+    ASSERT_EQ(inuseCount, 6u);
+    ASSERT_EQ(inuseBytes, 600u);
+    ASSERT_EQ(allocCount, 10u);
+    ASSERT_EQ(allocBytes, 1000u);
+    ASSERT_EQ(rate, 1u);
+    ASSERT_NE(profile.str().find("] @ 0x"), std::string::npos); // a stack trace
+    ASSERT_NE(profile.str().find("MAPPED_LIBRARIES:"), std::string::npos);
+
+    a.heapProfiler().setSampleRate(0);
+    void *unsampled = a.alloc(100);
+    ASSERT_EQ(a.heapProfiler().liveSamples(), 6u);
+    a.free(unsampled);
+    for (int i = 4; i < 10; i++) {
+        a.free(objs[i]);
+    }
+    ASSERT_EQ(a.heapProfiler().liveSamples(), 0u);
+    a.destroy();
+}
+
+TEST(heap_profiler_tests, test_estimated_live_bytes) {
+    MemoryAllocator a;
+    a.init();
+    a.heapProfiler().setSampleRate(4096);
+    const size_t count = 100000, size = 64;
+    std::vector<void *> objs;
+    for (size_t i = 0; i < count; i++) {
+        objs.push_back(a.alloc(size));
+    }
+    // about 1550 samples, 10% is four standard deviations
+    double estimate = a.heapProfiler().estimatedLiveBytes();
+    ASSERT_NEAR(estimate, (double) (count * size), 0.1 * count * size);
+    for (void *p : objs) {
+        a.free(p);
+    }
+    ASSERT_EQ(a.heapProfiler().liveSamples(), 0u);
+    a.destroy();
+}
+
+TEST(release_pages_tests, test_fixed_sized_release) {
+    FixedSizeAllocator a(256);
+    testReleaseEmptyPages(a, 256, 100000, 0);
+    testReleaseEmptyPages(a, 256, 100000, 1);
+}
+
+TEST(release_pages_tests, test_coalesce_release) {
+    CoalesceAllocator a;
+    testReleaseEmptyPages(a, 1 << 20, 60, 0);
+    testReleaseEmptyPages(a, 1 << 20, 60, 1);
+}
+
+TEST(common_allocators_tests, test_mem_alloc_routing) {
+    MemoryAllocator a;
+    a.init();
+    size_t sizes[] = {2, 100, 500, 1000, 100000, (size_t) 1 << 25};
+    std::vector<byte *> objs;
+    for (size_t size : sizes) {
+        byte *v = static_cast<byte *>(a.alloc(size));
+        v[0] = 1;
+        v[size - 1] = 2;
+        objs.push_back(v);
+    }
+    for (size_t i = 0; i < objs.size(); i++) {
+        ASSERT_EQ(objs[i][0], 1);
+        ASSERT_EQ(objs[i][sizes[i] - 1], 2);
+        a.free(objs[i]);
+    }
+    a.destroy();
+}
+
+TEST(common_allocators_tests, test_mem_alloc_size_classes) {
+    MemoryAllocator a({16, 48, 96, 192});
+    a.init();
+    size_t sizes[] = {1, 16, 17, 48, 49, 96, 150, 192, 193};
+    size_t usable[] = {16, 16, 48, 48, 96, 96, 192, 192, 0};
+    std::vector<void *> objs;
+    for (size_t i = 0; i < 9; i++) {
+        void *p = a.alloc(sizes[i]);
+        if (usable[i] != 0) {
+            ASSERT_EQ(a.usableSize(p), usable[i]);
+        } else {
+            ASSERT_GE(a.usableSize(p), sizes[i]); // above the last class
+        }
+        objs.push_back(p);
+    }
+    MemoryAllocatorStats snapshot = a.detailedStats();
+    ASSERT_EQ(snapshot.sizeClasses.size(), 4u);
+    ASSERT_EQ(snapshot.sizeClasses[2].blockSize, 96u);
+    ASSERT_EQ(snapshot.sizeClasses[2].allocs, 2u);
+    ASSERT_EQ(snapshot.coalesce.allocs, 1u);
+    for (void *p : objs) {
+        a.free(p);
+    }
+    a.destroy();
+    testAll(a);
+}
+
+TEST(numa_tests, test_simulated_nodes) {
+    NumaOptions old = numaOptions();
+    numaOptions().simulatedNodes = 2;
+    MemoryAllocator a;
+    a.init();
+    std::vector<byte *> objs[2];
+    for (size_t node = 0; node < 2; node++) {
+        std::thread([&a, &objs, node]() {
+            pinThreadToNumaNode(node);
+            for (int i = 0; i < 100; i++) {
+                objs[node].push_back(static_cast<byte *>(a.alloc(64)));
+            }
+            objs[node].push_back(static_cast<byte *>(a.alloc(10000)));
+        }).join();
+    }
+    MemoryAllocatorStats snapshot = a.detailedStats();
+    ASSERT_EQ(snapshot.nodes.size(), 2u);
+    for (size_t node = 0; node < 2; node++) {
+        ASSERT_GE(snapshot.nodes[node].bytesLive, 100 * 64 + 10000u);
+    }
+    for (byte *p : objs[0]) { // arenas of the nodes never share a page
+        for (byte *q : objs[1]) {
+            ASSERT_NE(reinterpret_cast<uintptr_t>(p) >> PageMap::REGION_SHIFT,
+                      reinterpret_cast<uintptr_t>(q) >> PageMap::REGION_SHIFT);
+        }
+    }
+
+    std::thread([&a, &objs]() {
+        pinThreadToNumaNode(1);
+        for (byte *p : objs[0]) {
+            a.free(p); // goes home to node 0
+        }
+        for (int i = 0; i < 100; i++) {
+            byte *p = static_cast<byte *>(a.alloc(64));
+            ASSERT_EQ(std::find(objs[0].begin(), objs[0].end(), p), objs[0].end());
+            objs[1].push_back(p);
+        }
+        for (byte *p : objs[1]) {
+            a.free(p);
+        }
+    }).join();
+    snapshot = a.detailedStats();
+    ASSERT_EQ(snapshot.nodes[0].bytesLive, 0u);
+    ASSERT_EQ(snapshot.nodes[1].bytesLive, 0u);
+    ASSERT_EQ(snapshot.sizeClasses[3].allocs, snapshot.sizeClasses[3].frees);
+    a.destroy();
+    numaOptions() = old;
+}
+
+TEST(multithreaded_tests, test_mem_alloc_threads) {
+    MemoryAllocator a;
+    a.init();
+    const int threadsCount = 8, iter = 20000;
+    std::vector<std::vector<int *>> produced(threadsCount);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadsCount; t++) {
+        threads.emplace_back([&a, &produced, t]() {
+            for (int i = 0; i < iter; i++) {
+                int *v = static_cast<int *>(a.alloc(sizeof(int) * (1 + i % 100)));
+                *v = t * iter + i;
+                produced[t].push_back(v);
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+    // every thread frees blocks allocated by its neighbour
+    for (int t = 0; t < threadsCount; t++) {
+        threads.emplace_back([&a, &produced, t]() {
+            int owner = (t + 1) % threadsCount;
+            for (int i = 0; i < iter; i++) {
+                ASSERT_EQ(*produced[owner][i], owner * iter + i);
+                a.free(produced[owner][i]);
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    a.destroy();
+}
+
+TEST(stl_allocator_tests, test_std_containers) {
+    MemoryAllocator a;
+    a.init();
+    {
+        std::vector<int, StlAllocator<int>> v{StlAllocator<int>(a)};
+        std::map<int, int, std::less<int>, StlAllocator<std::pair<const int, int>>> m{StlAllocator<int>(a)};
+        for (int i = 0; i < 10000; i++) {
+            v.push_back(i);
+            m[i] = -i;
+        }
+        for (int i = 0; i < 10000; i++) {
+            ASSERT_EQ(v[i], i);
+            ASSERT_EQ(m[i], -i);
+        }
+        ASSERT_GT(a.stats().bytesLive, 0u);
+    }
+    ASSERT_EQ(a.stats().bytesLive, 0u);
+    a.destroy();
+}
+
+TEST(stl_allocator_tests, test_dictionary_nodes_from_pool) {
+    FixedSizeAllocator pool(sizeof(myalg::node<int, int>));
+    pool.init();
+    {
+        myalg::Dictionary<int, int, StlAllocator<std::pair<const int, int>>> d{StlAllocator<int>(pool)};
+        for (int i = 0; i < 1000; i++) {
+            d.put(i, i * 2);
+        }
+        for (int i = 0; i < 1000; i += 2) {
+            d.remove(i);
+        }
+        ASSERT_EQ(pool.stats().allocs - pool.stats().frees, 500u);
+        for (int i = 1; i < 1000; i += 2) {
+            ASSERT_EQ(d.at(i), i * 2);
+        }
+    }
+    ASSERT_EQ(pool.stats().bytesLive, 0u);
+    pool.destroy();
+}
+
+TEST(stl_allocator_tests, test_list_chunks) {
+    MemoryAllocator a;
+    a.init();
+    {
+        myalg::List<int, StlAllocator<int>> list{StlAllocator<int>(a)};
+        for (int i = 0; i < 1000; i++) {
+            list.insertTail(i);
+            list.insertHead(-i);
+        }
+        for (int i = 0; i < 500; i++) {
+            list.removeHead();
+            list.removeTail();
+        }
+        ASSERT_EQ(list.size(), 1000);
+        ASSERT_EQ(list.head(), -499);
+        ASSERT_EQ(list.tail(), 499);
+    }
+    ASSERT_EQ(a.stats().bytesLive, 0u);
+    a.destroy();
+}
+
+TEST(common_allocators_tests, test_concurrent_fixed_sized) {
+    ConcurrentFixedSizeAllocator a(256);
+    testAll(a);
+}
+
+TEST(multithreaded_tests, test_concurrent_fixed_sized_threads) {
+    ConcurrentFixedSizeAllocator a(64);
+    a.init();
+    const int threads = 8, rounds = 20, perRound = 20000; // enough to exhaust several pages at once
+    std::vector<std::thread> workers;
+    std::vector<std::vector<size_t *>> handedOver(threads);
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&a, &handedOver, t]() {
+            std::vector<size_t *> objs;
+            for (int round = 0; round < rounds; round++) {
+                for (int i = 0; i < perRound; i++) {
+                    size_t *v = static_cast<size_t *>(a.alloc(64));
+                    v[1] = t;
+                    v[7] = i;
+                    objs.push_back(v);
+                }
+                for (int i = 0; i < perRound; i++) {
+                    ASSERT_EQ(objs[i][1], (size_t) t);
+                    ASSERT_EQ(objs[i][7], (size_t) i);
+                }
+                for (size_t *v : objs) {
+                    a.free(v);
+                }
+                objs.clear();
+            }
+            for (int i = 0; i < perRound; i++) {
+                handedOver[t].push_back(static_cast<size_t *>(a.alloc(64)));
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    for (int t = 0; t < threads; t++) { // every block is freed by a thread other than its allocator
+        workers.emplace_back([&a, &handedOver, t]() {
+            for (size_t *v : handedOver[(t + 1) % threads]) {
+                a.free(v);
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    AllocatorStats stats = a.stats();
+    ASSERT_EQ(stats.allocs, stats.frees);
+    ASSERT_EQ(stats.allocs, (size_t) threads * (rounds + 1) * perRound);
+    a.destroy();
+}
+
 TEST(print_test, dump_coalesce) {
     CoalesceAllocator a;
     testRandomAllocations(a, 10);
@@ -5,54 +5,78 @@
 #ifndef ARRAY_AND_LIST_ARRAY_H
 #define ARRAY_AND_LIST_ARRAY_H
 
+#include <algorithm>
+#include <memory>
+
 namespace myalg {
-    template<typename T>
+    /*
+     * Alloc is a standard allocator of T, the array keeps all capacity elements constructed
+     */
+    template<typename T, typename Alloc = std::allocator<T>>
     class Array final {
+        typedef std::allocator_traits<Alloc> traits;
+
+        Alloc _alloc;
         T* _data = nullptr;
         int _capacity = 0;
         int _size = 0;
 
     private:
         void create_new_array(int capacity) {
-            _data = new T[capacity];
+            _data = traits::allocate(_alloc, capacity);
+            for (int i = 0; i < capacity; i++) {
+                traits::construct(_alloc, _data + i);
+            }
             this->_capacity = capacity;
         }
 
+        void delete_array(T* data, int capacity) {
+            if (data == nullptr) return;
+            for (int i = 0; i < capacity; i++) {
+                traits::destroy(_alloc, data + i);
+            }
+            traits::deallocate(_alloc, data, capacity);
+        }
+
         void size_check() {
             if (_size >= _capacity) {
                 T* old_data = _data;
                 int old_size = _capacity;
-                create_new_array(_capacity * 2);
+                create_new_array(std::max(_capacity * 2, _size + 1));
                 std::move(old_data, old_data + old_size, _data);
-                delete[] old_data;
+                delete_array(old_data, old_size);
             }
         }
 
     public:
-        explicit Array(int capacity) {
+        explicit Array(int capacity, const Alloc &alloc = Alloc()) : _alloc(alloc) {
             create_new_array(capacity);
         }
 
-        Array() {
+        explicit Array(const Alloc &alloc) : _alloc(alloc) {
             create_new_array(16);
         }
 
-        Array(const Array<T> &array) {
+        Array() : Array(Alloc()) {}
+
+        Array(const Array &array) : _alloc(traits::select_on_container_copy_construction(array._alloc)) {
             create_new_array(array._capacity);
             _size = array._size;
             std::copy(array._data, array._data + _size, _data);
         }
 
         ~Array() {
+            delete_array(_data, _capacity);
             _size = 0;
             _capacity = 0;
-            delete _data;
         }
 
-        Array<T>& operator=(Array<T> array) {
+        Array& operator=(Array array) {
+            std::swap(_alloc, array._alloc);
             std::swap(_data, array._data);
             std::swap(_size, array._size);
             std::swap(_capacity, array._capacity);
+            return *this;
         }
 
         void insert(int index, const T &value) {
@@ -95,9 +119,9 @@ namespace myalg {
             friend Array;
 
             int _index = 0;
-            Array<T> &_array;
+            Array &_array;
 
-            explicit Iterator(Array<T> &array) : _array(array) {}
+            explicit Iterator(Array &array) : _array(array) {}
 
         public:
 
@@ -7,17 +7,22 @@
 
 #include "array.h"
 
+#include <memory>
+
 namespace myalg {
-    template<typename T>
+    /*
+     * Alloc is a standard allocator of T, it is rebound to allocate chunk nodes and their arrays
+     */
+    template<typename T, typename Alloc = std::allocator<T>>
     class List final {
         class Node {
         public:
-            Array<T> data;
+            Array<T, Alloc> data;
             Node *prev = nullptr, *next = nullptr;
 
             static const int CHUNK_SIZE = 4;
 
-            Node(Node *prev, Node *next) : prev(prev), next(next), data(CHUNK_SIZE) {
+            Node(Node *prev, Node *next, const Alloc &alloc) : data(CHUNK_SIZE, alloc), prev(prev), next(next) {
                 (prev != nullptr ? prev->next : this->prev) = this;
                 (next != nullptr ? next->prev : this->next) = this;
             }
@@ -44,29 +49,47 @@ namespace myalg {
             }
         };
 
+        typedef typename std::allocator_traits<Alloc>::template rebind_alloc<Node> NodeAlloc;
+        typedef std::allocator_traits<NodeAlloc> node_traits;
+
+        NodeAlloc _nodeAlloc;
+        Alloc _alloc;
         Node *_head, *_tail = nullptr;
         int _size = 0;
 
+    private:
+        Node* new_node(Node *prev, Node *next) {
+            Node* node = node_traits::allocate(_nodeAlloc, 1);
+            node_traits::construct(_nodeAlloc, node, prev, next, _alloc);
+            return node;
+        }
+
+        void delete_node(Node *node) {
+            node_traits::destroy(_nodeAlloc, node);
+            node_traits::deallocate(_nodeAlloc, node, 1);
+        }
+
     public:
-        List() {
-            _head = _tail = new Node(nullptr, nullptr);
+        explicit List(const Alloc &alloc = Alloc()) : _nodeAlloc(alloc), _alloc(alloc) {
+            _head = _tail = new_node(nullptr, nullptr);
             _size = 0;
         }
 
         List(const List& node) = delete;
 
         ~List() {
-            for (Node* node = _head; !node->isTail();) {
+            for (Node* node = _head; node != nullptr;) {
                 Node* currentNode = node;
-                node = node->next;
-                delete currentNode;
+                node = node->isTail() ? nullptr : node->next;
+                // unlinked node does not touch its already deleted neighbours
+                currentNode->prev = currentNode->next = currentNode;
+                delete_node(currentNode);
             }
-            delete _tail;
         }
 
         void insertHead(const T& value) {
             if (_head->isFull()) {
-                _head = new Node(nullptr, _head);
+                _head = new_node(nullptr, _head);
             }
             _head->data.insert(0, value);
             _size++;
@@ -74,7 +97,7 @@ namespace myalg {
 
         void insertTail(const T& value) {
             if (_tail->isFull()) {
-                _tail = new Node(_tail, nullptr);
+                _tail = new_node(_tail, nullptr);
             }
             _tail->data.insert(value);
             _size++;
@@ -88,7 +111,7 @@ namespace myalg {
             _head->data.remove(0);
             if (_head->isEmpty() && !_head->isTail()) {
                 _head = _head->next;
-                delete _head->prev;
+                delete_node(_head->prev);
                 _head->prev = _head;
             }
             _size--;
@@ -98,7 +121,7 @@ namespace myalg {
             _tail->data.remove(_tail->data.size() - 1);
             if (_tail->isEmpty() && !_tail->isHead()) {
                 _tail = _tail->prev;
-                delete _tail->next;
+                delete_node(_tail->next);
                 _tail->next = _tail;
             }
             _size--;
@@ -113,11 +136,11 @@ namespace myalg {
         }
 
         class Iterator {
-            List<T> *list;
+            List *list;
             Node *_node;
             int _index;
 
-            explicit Iterator(List<T> *list) : list(list), _node(list->_head), _index(0) {}
+            explicit Iterator(List *list) : list(list), _node(list->_head), _index(0) {}
             friend class List;
         public:
             const T& get() const {
@@ -131,9 +154,9 @@ namespace myalg {
             void insert(const T &value) {
                 if (_node->isFull()) {
                     if (_node->isTail()) {
-                        list->_tail = new Node(_node, nullptr);
+                        list->_tail = list->new_node(_node, nullptr);
                     } else {
-                        new Node(_node, _node->next);
+                        list->new_node(_node, _node->next);
                     }
                     for (int i = _index; i < Node::CHUNK_SIZE; i++) {
                         _node->next->data.insert(std::move(_node->data[i]));
@@ -154,7 +177,7 @@ namespace myalg {
                 while (_node->isEmpty()) {
                     if (_node->isTail() && !_node->isHead()) {
                         list->_tail = _node->prev;
-                        delete _node;
+                        list->delete_node(_node);
                         _node = list->_tail;
                         _node->next = _node;
                         _index = _node->data.last();
@@ -0,0 +1,387 @@
+#ifndef SORT_EXTERNAL_SORT_H
+#define SORT_EXTERNAL_SORT_H
+
+#include "sort.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace myalg {
+    struct external_sort_options {
+        // bytes of records held at once: the chunks sorted in memory, later the I/O blocks of a merge
+        size_t memory_limit = (size_t) 256 << 20;
+        // the smallest block a run is read by in a merge, more runs than fit are merged in several passes
+        size_t min_block_size = (size_t) 1 << 20;
+        // read the next chunk or block and write the last one while the current one is sorted or merged,
+        // this halves the blocks, as each one has a twin in flight
+        bool async_io = true;
+        // directory of the run files, by default they are std::tmpfile
+        std::string temp_directory;
+    };
+
+    struct external_sort_stats {
+        size_t records = 0;
+        size_t bytes = 0;
+        size_t runs = 0;
+        size_t merge_passes = 0; // the most merges one record went through, the final one included
+        double run_seconds = 0;
+        double merge_seconds = 0;
+
+        // bytes per second, over both phases
+        double throughput() const {
+            double seconds = run_seconds + merge_seconds;
+            return seconds > 0 ? (double) bytes / seconds : 0;
+        }
+    };
+
+    /*
+     * Creates a new file named prefix and a random suffix for reading and writing, path gets its name.
+     * The file is opened exclusively, so a name taken by another process or another sort is never shared,
+     * the next suffix is tried instead.
+     */
+    inline std::FILE *create_unique_file(const std::string &prefix, std::string &path) {
+        static const uint64_t seed = (uint64_t) std::random_device()() << 32 ^
+                                     (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count();
+        static std::atomic<uint64_t> counter{0};
+        for (int attempt = 0; attempt < 100; attempt++) {
+            path = prefix + std::to_string((seed + counter++) * 0x9e3779b97f4a7c15ull);
+            std::FILE *file = std::fopen(path.c_str(), "w+bx");
+            if (file != nullptr) return file;
+            if (errno != EEXIST) break;
+        }
+        path.clear();
+        return nullptr;
+    }
+
+    // a sorted run spilled to a temporary file
+    struct external_run {
+        std::FILE *file = nullptr;
+        std::string path; // empty for std::tmpfile, which goes away by itself
+        size_t records = 0;
+        size_t merges = 0; // merges its records went through
+
+        bool open(const std::string &directory) {
+            file = directory.empty() ? std::tmpfile() : create_unique_file(directory + "/myalg-run-", path);
+            return file != nullptr;
+        }
+
+        void close() {
+            if (file != nullptr) std::fclose(file);
+            if (!path.empty()) std::remove(path.c_str());
+            file = nullptr;
+            path.clear();
+        }
+    };
+
+    // reads a run block by block, with async_io the next block is read meanwhile
+    template<typename T>
+    class external_run_reader {
+        std::FILE *file;
+        size_t left; // records of the file not read yet
+        size_t block;
+        bool async;
+        std::vector<T> current, next;
+        size_t position = 0, size = 0;
+        std::future<size_t> pending;
+
+    public:
+        bool failed = false;
+
+        external_run_reader(std::FILE *file, size_t records, size_t block, bool async)
+                : file(file), left(records), block(block), async(async), current(block), next(async ? block : 0) {
+            std::rewind(file);
+            fill();
+        }
+
+        ~external_run_reader() {
+            if (pending.valid()) pending.wait();
+        }
+
+        inline bool empty() const {
+            return position == size;
+        }
+
+        inline const T &head() const {
+            return current[position];
+        }
+
+        inline void pop() {
+            if (++position == size) fill();
+        }
+
+    private:
+        // runs in the thread of the read in flight, if any, the fields it changes are read after it is done
+        size_t read(T *to) {
+            size_t n = std::min(left, block);
+            left -= n;
+            if (std::fread(to, sizeof(T), n, file) != n) {
+                failed = true;
+                left = 0;
+                return 0;
+            }
+            return n;
+        }
+
+        void fill() {
+            if (pending.valid()) {
+                size = pending.get();
+                std::swap(current, next);
+            } else {
+                size = read(current.data());
+            }
+            position = 0;
+            if (async && left > 0) {
+                pending = std::async(std::launch::async, [this]() { return read(next.data()); });
+            }
+        }
+    };
+
+    // writes records in blocks, with async_io the last block is written while the next one fills
+    template<typename T>
+    class external_writer {
+        std::FILE *file;
+        bool async;
+        std::vector<T> current, next;
+        size_t size = 0;
+        std::future<bool> pending;
+        bool ok = true;
+
+    public:
+        external_writer(std::FILE *file, size_t block, bool async)
+                : file(file), async(async), current(block), next(async ? block : 0) {}
+
+        ~external_writer() {
+            if (pending.valid()) pending.wait();
+        }
+
+        inline void push(const T &x) {
+            current[size++] = x;
+            if (size == current.size()) flush();
+        }
+
+        void flush() {
+            if (size == 0) return;
+            if (async) {
+                if (pending.valid()) ok &= pending.get();
+                std::swap(current, next);
+                size_t n = size;
+                pending = std::async(std::launch::async, [this, n]() {
+                    return std::fwrite(next.data(), sizeof(T), n, file) == n;
+                });
+            } else {
+                ok &= std::fwrite(current.data(), sizeof(T), size, file) == size;
+            }
+            size = 0;
+        }
+
+        bool finish() {
+            flush();
+            if (pending.valid()) ok &= pending.get();
+            return ok && std::fflush(file) == 0;
+        }
+    };
+
+    /*
+     * Tournament tree of k sources which keeps the loser of every match in its node, so when the winner
+     * is replaced by the next element of its source only the matches on the path from its leaf are replayed,
+     * one comparison per level. Exhausted sources lose every match, ties go to the lower source.
+     */
+    template<typename T, typename Compare>
+    class loser_tree {
+        std::vector<std::unique_ptr<external_run_reader<T>>> &sources;
+        Compare comp;
+        size_t k;
+        std::vector<size_t> tree; // tree[0] is the winner, tree[1..k) the losers, leaves are k..2k
+
+        bool beats(size_t a, size_t b) const {
+            if (sources[b]->empty()) return true;
+            if (sources[a]->empty()) return false;
+            if (comp(sources[a]->head(), sources[b]->head())) return true;
+            return !comp(sources[b]->head(), sources[a]->head()) && a < b;
+        }
+
+    public:
+        loser_tree(std::vector<std::unique_ptr<external_run_reader<T>>> &sources, Compare comp)
+                : sources(sources), comp(comp), k(sources.size()), tree(sources.size()) {
+            std::vector<size_t> winners(2 * k);
+            for (size_t s = 0; s < k; s++) {
+                winners[k + s] = s;
+            }
+            for (size_t node = k - 1; node > 0; node--) {
+                size_t a = winners[2 * node], b = winners[2 * node + 1];
+                if (!beats(a, b)) std::swap(a, b);
+                winners[node] = a;
+                tree[node] = b;
+            }
+            tree[0] = k > 1 ? winners[1] : 0;
+        }
+
+        inline size_t winner() const {
+            return tree[0];
+        }
+
+        // the source of the winner has moved on
+        void replay() {
+            size_t winner = tree[0];
+            for (size_t node = (winner + k) / 2; node > 0; node /= 2) {
+                if (beats(tree[node], winner)) std::swap(tree[node], winner);
+            }
+            tree[0] = winner;
+        }
+    };
+
+    // k-way merge of runs into out, every run is read by blocks of block records
+    template<typename T, typename Compare>
+    bool merge_external_runs(const std::vector<external_run> &runs, std::FILE *out, Compare comp, size_t block,
+                             bool async) {
+        // readers stay in place, their reads in flight hold pointers to them
+        std::vector<std::unique_ptr<external_run_reader<T>>> readers;
+        for (const external_run &run : runs) {
+            readers.emplace_back(new external_run_reader<T>(run.file, run.records, block, async));
+        }
+        external_writer<T> writer(out, block, async);
+        loser_tree<T, Compare> tree(readers, comp);
+        while (!readers[tree.winner()]->empty()) {
+            external_run_reader<T> &reader = *readers[tree.winner()];
+            writer.push(reader.head());
+            reader.pop();
+            tree.replay();
+        }
+        bool ok = writer.finish();
+        for (const auto &reader : readers) {
+            ok &= !reader->failed;
+        }
+        return ok;
+    }
+
+    /*
+     * Sorts a file of fixed width records T by comp into another file, using about options.memory_limit bytes.
+     * Runs: chunks of the input which fit into memory are sorted by sort and spilled to temporary files
+     * (input which fits at once is written to output directly). Merge: runs are merged by a loser tree, each read
+     * by large sequential blocks; when there are so many that blocks would get shorter than min_block_size,
+     * groups of runs are merged into longer runs first. Returns false on I/O errors, stats gets sizes and times.
+     * The output goes to a new file next to output_path which replaces it on success, so the input may be
+     * the output, and a failed sort leaves the output as it was.
+     */
+    template<typename T, typename Compare>
+    bool external_sort(const char *input_path, const char *output_path, Compare comp,
+                       const external_sort_options &options = external_sort_options(),
+                       external_sort_stats *stats = nullptr) {
+        static_assert(std::is_trivially_copyable<T>::value, "records are read and written as bytes");
+        typedef std::chrono::steady_clock clock;
+        external_sort_stats local_stats;
+        external_sort_stats &s = stats != nullptr ? *stats : local_stats;
+        s = external_sort_stats();
+        size_t buffers = options.async_io ? 2 : 1;
+
+        std::FILE *input = std::fopen(input_path, "rb");
+        if (input == nullptr) return false;
+        std::string output_temp;
+        std::FILE *output = create_unique_file(std::string(output_path) + ".myalg-", output_temp);
+        if (output == nullptr) {
+            std::fclose(input);
+            return false;
+        }
+        std::vector<external_run> runs;
+        auto cleanup = [&](bool ok) {
+            for (external_run &run : runs) {
+                run.close();
+            }
+            std::fclose(input);
+            ok &= std::fclose(output) == 0;
+            ok = ok && std::rename(output_temp.c_str(), output_path) == 0;
+            if (!ok) std::remove(output_temp.c_str());
+            return ok;
+        };
+
+        auto start = clock::now();
+        size_t chunk = std::max<size_t>(options.memory_limit / buffers / sizeof(T), 1);
+        std::vector<T> current(chunk), next(options.async_io ? chunk : 0);
+        // bytes, not records, are read, so a partial record at the end shows
+        auto read_chunk = [&](T *to) {
+            return std::fread(to, 1, chunk * sizeof(T), input);
+        };
+        size_t bytes = read_chunk(current.data());
+        while (bytes > 0) {
+            if (bytes % sizeof(T) != 0) return cleanup(false); // a partial record at the end
+            size_t size = bytes / sizeof(T);
+            std::future<size_t> pending;
+            if (options.async_io && size == chunk) {
+                pending = std::async(std::launch::async, read_chunk, next.data());
+            }
+            sort(current.data(), current.data() + size, comp);
+            s.records += size;
+            bool ok;
+            if (runs.empty() && size < chunk) {
+                ok = std::fwrite(current.data(), sizeof(T), size, output) == size; // the only run
+            } else {
+                runs.emplace_back();
+                ok = runs.back().open(options.temp_directory) &&
+                     std::fwrite(current.data(), sizeof(T), size, runs.back().file) == size &&
+                     std::fflush(runs.back().file) == 0;
+                runs.back().records = size;
+            }
+            if (pending.valid()) {
+                bytes = pending.get();
+                std::swap(current, next);
+            } else {
+                bytes = size == chunk ? read_chunk(current.data()) : 0;
+            }
+            if (!ok) return cleanup(false);
+        }
+        if (std::ferror(input)) return cleanup(false);
+        std::vector<T>().swap(current);
+        std::vector<T>().swap(next);
+        s.bytes = s.records * sizeof(T);
+        s.runs = std::max<size_t>(runs.size(), s.records > 0 ? 1 : 0);
+        auto middle = clock::now();
+        s.run_seconds = std::chrono::duration<double>(middle - start).count();
+
+        // runs and the output each need buffers blocks of at least min_block_size
+        size_t block_bytes = std::max(options.min_block_size, sizeof(T));
+        size_t fan_in = std::max<size_t>(options.memory_limit / (buffers * block_bytes), 3) - 1;
+        size_t next_run = 0;
+        while (runs.size() - next_run > fan_in) {
+            std::vector<external_run> group(runs.begin() + next_run, runs.begin() + next_run + fan_in);
+            external_run merged;
+            if (!merged.open(options.temp_directory)) return cleanup(false);
+            for (const external_run &run : group) {
+                merged.records += run.records;
+                merged.merges = std::max(merged.merges, run.merges + 1);
+            }
+            size_t block = std::max<size_t>(options.memory_limit / ((fan_in + 1) * buffers) / sizeof(T), 1);
+            bool ok = merge_external_runs<T>(group, merged.file, comp, block, options.async_io);
+            for (size_t i = next_run; i < next_run + fan_in; i++) {
+                runs[i].close();
+            }
+            next_run += fan_in;
+            runs.push_back(merged);
+            if (!ok) return cleanup(false);
+        }
+        if (!runs.empty()) {
+            std::vector<external_run> group(runs.begin() + next_run, runs.end());
+            size_t block = std::max<size_t>(options.memory_limit / ((group.size() + 1) * buffers) / sizeof(T), 1);
+            bool ok = merge_external_runs<T>(group, output, comp, block, options.async_io);
+            for (const external_run &run : group) {
+                s.merge_passes = std::max(s.merge_passes, run.merges + 1);
+            }
+            if (!ok) return cleanup(false);
+        }
+        s.merge_seconds = std::chrono::duration<double>(clock::now() - middle).count();
+        return cleanup(true);
+    }
+}
+
+#endif //SORT_EXTERNAL_SORT_H
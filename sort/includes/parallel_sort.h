@@ -0,0 +1,136 @@
+#ifndef SORT_PARALLEL_SORT_H
+#define SORT_PARALLEL_SORT_H
+
+#include "sort.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace myalg {
+    // shorter ranges are not worth starting threads for
+    const ptrdiff_t PARALLEL_SORT_LENGTH = 1 << 16;
+    // buckets per thread, the spare ones even out buckets of different sizes
+    const int PARALLEL_SORT_BUCKETS_PER_THREAD = 4;
+    // samples per bucket from which the splitters are taken
+    const int PARALLEL_SORT_OVERSAMPLING = 16;
+
+    // calls f(0), ..., f(threads - 1) in threads of their own, f(0) in the calling one
+    template<typename F>
+    void run_threads(int threads, F f) {
+        std::vector<std::thread> workers;
+        for (int t = 1; t < threads; t++) {
+            workers.emplace_back(f, t);
+        }
+        f(0);
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    // number of splitters s with !comp(x, s), splitters are sorted
+    template<typename T, typename Compare>
+    inline int bucket_of(const T &x, const T *splitters, int count, Compare comp) {
+        int low = 0, high = count;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (comp(x, splitters[mid])) high = mid;
+            else low = mid + 1;
+        }
+        return low;
+    }
+
+    /*
+     * Parallel sample sort. Splitters are taken from a sorted random sample, every thread counts
+     * the buckets of the elements of its chunk, then moves them into a buffer at offsets of a prefix sum,
+     * then threads take buckets from a shared counter, the biggest first, sort them by sort and move them back.
+     * An element equal to a splitter goes to a bucket of its own which needs no sorting, so
+     * heavy duplicates do not make one bucket big.
+     * Needs a buffer of n elements (T must be default constructible) and two bytes per element.
+     * threads = 0 uses all hardware threads. comp must not throw.
+     */
+    template<typename T, typename Compare>
+    void parallel_sort(T *first, T *last, Compare comp, int threads = 0) {
+        ptrdiff_t n = last - first;
+        if (threads <= 0) threads = std::max(1, (int) std::thread::hardware_concurrency());
+        threads = (int) std::min<ptrdiff_t>(threads, n / (PARALLEL_SORT_LENGTH / 4) + 1);
+        if (threads == 1 || n < PARALLEL_SORT_LENGTH) {
+            sort(first, last, comp);
+            return;
+        }
+
+        int ranges = std::min(threads * PARALLEL_SORT_BUCKETS_PER_THREAD, 1 << 14);
+        std::vector<T> sample;
+        std::mt19937_64 random((uint64_t) n);
+        std::uniform_int_distribution<ptrdiff_t> position(0, n - 1);
+        for (int i = 0; i < ranges * PARALLEL_SORT_OVERSAMPLING; i++) {
+            sample.push_back(first[position(random)]);
+        }
+        sort(sample.data(), sample.data() + sample.size(), comp);
+        std::vector<T> splitters;
+        for (int i = 1; i < ranges; i++) {
+            splitters.push_back(sample[i * PARALLEL_SORT_OVERSAMPLING]);
+        }
+        int splitters_count = ranges - 1;
+        // range r holds elements between splitters r - 1 and r, bucket 2r, an element equal to splitter r - 1
+        // goes to bucket 2r - 1
+        int buckets = 2 * ranges - 1;
+
+        std::unique_ptr<uint16_t[]> bucket(new uint16_t[n]);
+        std::vector<ptrdiff_t> counts((size_t) threads * buckets);
+        ptrdiff_t chunk = (n + threads - 1) / threads;
+        run_threads(threads, [&](int t) {
+            ptrdiff_t *count = &counts[(size_t) t * buckets];
+            for (ptrdiff_t i = t * chunk, end = std::min(n, i + chunk); i < end; i++) {
+                int r = bucket_of(first[i], splitters.data(), splitters_count, comp);
+                int b = r > 0 && !comp(splitters[r - 1], first[i]) ? 2 * r - 1 : 2 * r;
+                bucket[i] = (uint16_t) b;
+                count[b]++;
+            }
+        });
+
+        // offsets of bucket b ordered by bucket, then by thread
+        std::vector<ptrdiff_t> offsets((size_t) threads * buckets);
+        std::vector<ptrdiff_t> starts(buckets + 1);
+        ptrdiff_t sum = 0;
+        for (int b = 0; b < buckets; b++) {
+            starts[b] = sum;
+            for (int t = 0; t < threads; t++) {
+                offsets[(size_t) t * buckets + b] = sum;
+                sum += counts[(size_t) t * buckets + b];
+            }
+        }
+        starts[buckets] = sum;
+
+        std::unique_ptr<T[]> buffer(new T[n]);
+        run_threads(threads, [&](int t) {
+            ptrdiff_t *offset = &offsets[(size_t) t * buckets];
+            for (ptrdiff_t i = t * chunk, end = std::min(n, i + chunk); i < end; i++) {
+                buffer[offset[bucket[i]]++] = std::move(first[i]);
+            }
+        });
+
+        std::vector<int> order(buckets);
+        for (int b = 0; b < buckets; b++) order[b] = b;
+        std::sort(order.begin(), order.end(), [&starts](int a, int b) {
+            return starts[a + 1] - starts[a] > starts[b + 1] - starts[b];
+        });
+        std::atomic<int> next{0};
+        run_threads(threads, [&](int) {
+            for (int i = next++; i < buckets; i = next++) {
+                int b = order[i];
+                T *from = buffer.get() + starts[b], *to = buffer.get() + starts[b + 1];
+                if (b % 2 == 0) sort(from, to, comp);
+                std::move(from, to, first + starts[b]);
+            }
+        });
+    }
+}
+
+#endif //SORT_PARALLEL_SORT_H
@@ -0,0 +1,218 @@
+#ifndef SORT_RADIX_SORT_H
+#define SORT_RADIX_SORT_H
+
+#include "sort.h"
+#include "stable_sort.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace myalg {
+    // shorter ranges are sorted by stable_sort, radix passes do not pay off there
+    const ptrdiff_t RADIX_SORT_LENGTH = 1 << 10;
+    // buckets of american_flag_sort shorter than this are sorted by sort
+    const ptrdiff_t AMERICAN_FLAG_SORT_LENGTH = 64;
+    const int RADIX_BITS = 8;
+    const int RADIX = 1 << RADIX_BITS;
+
+    /*
+     * radix_traits<K>::bits maps a key to an unsigned integer of the same size which orders as the key:
+     * the sign bit of signed integers is flipped, negative floats have all bits flipped and
+     * the others only the sign bit (NaNs go to the ends, -0.0 before 0.0).
+     */
+    template<typename K, typename = void>
+    struct radix_traits;
+
+    template<typename K>
+    struct radix_traits<K, typename std::enable_if<std::is_integral<K>::value>::type> {
+        typedef typename std::make_unsigned<K>::type type;
+
+        static inline type bits(K key) {
+            const type sign = std::is_signed<K>::value ? (type) 1 << (8 * sizeof(K) - 1) : 0;
+            return (type) key ^ sign;
+        }
+    };
+
+    template<typename K>
+    struct radix_traits<K, typename std::enable_if<std::is_floating_point<K>::value && sizeof(K) == 4>::type> {
+        typedef uint32_t type;
+
+        static inline type bits(K key) {
+            type b;
+            std::memcpy(&b, &key, sizeof(b));
+            return b ^ ((type) -(int32_t) (b >> 31) | (type) 1 << 31);
+        }
+    };
+
+    template<typename K>
+    struct radix_traits<K, typename std::enable_if<std::is_floating_point<K>::value && sizeof(K) == 8>::type> {
+        typedef uint64_t type;
+
+        static inline type bits(K key) {
+            type b;
+            std::memcpy(&b, &key, sizeof(b));
+            return b ^ ((type) -(int64_t) (b >> 63) | (type) 1 << 63);
+        }
+    };
+
+    // the key of an arithmetic value is the value, the key of a pair is its first element
+    struct radix_default_key {
+        template<typename T>
+        inline const T &operator()(const T &x) const {
+            return x;
+        }
+
+        template<typename K, typename V>
+        inline const K &operator()(const std::pair<K, V> &x) const {
+            return x.first;
+        }
+    };
+
+    template<typename T, typename Key>
+    struct radix_bits {
+        typedef typename std::decay<typename std::result_of<Key(const T &)>::type>::type key_type;
+        typedef radix_traits<key_type> traits;
+        typedef typename traits::type type;
+
+        Key key;
+
+        inline type operator()(const T &x) const {
+            return traits::bits(key(x));
+        }
+    };
+
+    /*
+     * LSD radix sort by key(x) with 8 bit digits. Histograms of all digits are counted in one pass,
+     * a digit which puts every element into the same bucket is skipped without moving anything.
+     * Stable, needs a buffer of n elements (T must be default constructible).
+     * Ranges shorter than RADIX_SORT_LENGTH go to stable_sort.
+     */
+    template<typename T, typename Key>
+    void radix_sort(T *first, T *last, Key key) {
+        typedef radix_bits<T, Key> bits_of;
+        typedef typename bits_of::type U;
+        const int DIGITS = sizeof(U);
+        bits_of bits{key};
+        ptrdiff_t n = last - first;
+        if (n < RADIX_SORT_LENGTH) {
+            stable_sort(first, last, [&bits](const T &a, const T &b) { return bits(a) < bits(b); });
+            return;
+        }
+
+        std::unique_ptr<ptrdiff_t[]> counts(new ptrdiff_t[DIGITS * RADIX]());
+        for (T *i = first; i < last; i++) {
+            U b = bits(*i);
+            for (int d = 0; d < DIGITS; d++) {
+                counts[d * RADIX + (b >> (d * RADIX_BITS) & (RADIX - 1))]++;
+            }
+        }
+
+        std::unique_ptr<T[]> buffer;
+        T *from = first, *to = nullptr;
+        U some = bits(*first);
+        for (int d = 0; d < DIGITS; d++) {
+            ptrdiff_t *count = &counts[d * RADIX];
+            int shift = d * RADIX_BITS;
+            if (count[some >> shift & (RADIX - 1)] == n) continue;
+            if (to == nullptr) {
+                buffer.reset(new T[n]);
+                to = buffer.get();
+            }
+            ptrdiff_t sum = 0;
+            for (int b = 0; b < RADIX; b++) {
+                ptrdiff_t c = count[b];
+                count[b] = sum;
+                sum += c;
+            }
+            for (T *i = from; i < from + n; i++) {
+                to[count[bits(*i) >> shift & (RADIX - 1)]++] = std::move(*i);
+            }
+            std::swap(from, to);
+        }
+        if (from != first) {
+            std::move(from, from + n, first);
+        }
+    }
+
+    template<typename T>
+    void radix_sort(T *first, T *last) {
+        radix_sort(first, last, radix_default_key());
+    }
+
+    template<typename T, typename Bits>
+    void american_flag_pass(T *first, T *last, int shift, const Bits &bits) {
+        while (true) {
+            ptrdiff_t n = last - first;
+            if (n < AMERICAN_FLAG_SORT_LENGTH) {
+                sort(first, last, [&bits](const T &a, const T &b) { return bits(a) < bits(b); });
+                return;
+            }
+            ptrdiff_t count[RADIX] = {};
+            for (T *i = first; i < last; i++) {
+                count[bits(*i) >> shift & (RADIX - 1)]++;
+            }
+            if (count[bits(*first) >> shift & (RADIX - 1)] == n) {
+                if (shift == 0) return;
+                shift -= RADIX_BITS;
+                continue;
+            }
+
+            // head[b] is the first element of bucket b which may be misplaced, tail[b] is the end of the bucket
+            ptrdiff_t head[RADIX], tail[RADIX];
+            ptrdiff_t sum = 0;
+            for (int b = 0; b < RADIX; b++) {
+                head[b] = sum;
+                sum += count[b];
+                tail[b] = sum;
+            }
+            // every element is carried along its cycle to its bucket, taking the element there
+            for (int b = 0; b < RADIX; b++) {
+                while (head[b] < tail[b]) {
+                    T value = std::move(first[head[b]]);
+                    int d = (int) (bits(value) >> shift & (RADIX - 1));
+                    while (d != b) {
+                        std::swap(value, first[head[d]++]);
+                        d = (int) (bits(value) >> shift & (RADIX - 1));
+                    }
+                    first[head[b]++] = std::move(value);
+                }
+            }
+
+            if (shift > 0) {
+                for (int b = 0; b < RADIX; b++) {
+                    if (count[b] > 1) {
+                        american_flag_pass(first + tail[b] - count[b], first + tail[b], shift - RADIX_BITS, bits);
+                    }
+                }
+            }
+            return;
+        }
+    }
+
+    /*
+     * In place MSD radix sort (American flag sort) by key(x) with 8 bit digits, for when there is
+     * no memory for the buffer of radix_sort. Elements are permuted into the buckets of the top digit
+     * by cycles, buckets are sorted by the next digits recursively. Not stable.
+     */
+    template<typename T, typename Key>
+    void american_flag_sort(T *first, T *last, Key key) {
+        typedef radix_bits<T, Key> bits_of;
+        bits_of bits{key};
+        if (last - first < RADIX_SORT_LENGTH) {
+            sort(first, last, [&bits](const T &a, const T &b) { return bits(a) < bits(b); });
+            return;
+        }
+        american_flag_pass(first, last, (int) (sizeof(typename bits_of::type) - 1) * RADIX_BITS, bits);
+    }
+
+    template<typename T>
+    void american_flag_sort(T *first, T *last) {
+        american_flag_sort(first, last, radix_default_key());
+    }
+}
+
+#endif //SORT_RADIX_SORT_H
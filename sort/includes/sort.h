@@ -3,10 +3,41 @@
 
 #include <cassert>
 #include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+#include "sorting_network.h"
 
 namespace myalg {
     bool use_insertion_sort = true;
     const int INSERTION_SORT_LENGTH = 11;
+    // pivot is the median of three medians of three from this length on
+    const int NINTHER_THRESHOLD = 128;
+    // partial insertion sort gives up after this many moved elements
+    const int PARTIAL_INSERTION_SORT_LIMIT = 8;
+    // ranges sorted by sorting_network_sort instead of insertion_sort when the comparison is branchless
+    // (a range of 24 goes to the network of 32, longer leaves lose more to partitions than they win)
+    const int NETWORK_SORT_LENGTH = 24;
+    // elements classified by partition_right_branchless before the misplaced ones are swapped
+    const int PARTITION_BLOCK_SIZE = 64;
+
+    // comparisons which compile to a flag, not to a branch: arithmetic keys with the standard comparators
+    template<typename T, typename Compare>
+    struct is_branchless_compare : std::false_type {};
+
+    template<typename T>
+    struct is_branchless_compare<T, std::less<T>> : std::is_arithmetic<T> {};
+
+    template<typename T>
+    struct is_branchless_compare<T, std::greater<T>> : std::is_arithmetic<T> {};
+
+    template<typename T>
+    struct is_branchless_compare<T, std::less<>> : std::is_arithmetic<T> {};
+
+    template<typename T>
+    struct is_branchless_compare<T, std::greater<>> : std::is_arithmetic<T> {};
 
     template<typename T, typename Compare>
     void partition(T *&first, T *&last, T m, Compare comp) {
@@ -33,29 +64,279 @@ namespace myalg {
     }
 
     template<typename T, typename Compare>
-    void sort(T *first, T *last, Compare comp) {
-        while (first < last) {
-            int n = last - first;
+    inline void leaf_sort(T *first, T *last, Compare comp, std::true_type) {
+        sorting_network_sort(first, last, comp);
+    }
+
+    template<typename T, typename Compare>
+    inline void leaf_sort(T *first, T *last, Compare comp, std::false_type) {
+        insertion_sort(first, last, comp);
+    }
+
+    template<typename T, typename Compare>
+    void sift_down(T *first, ptrdiff_t i, ptrdiff_t n, Compare comp) {
+        T value = std::move(first[i]);
+        for (ptrdiff_t child = 2 * i + 1; child < n; child = 2 * i + 1) {
+            if (child + 1 < n && comp(first[child], first[child + 1])) child++;
+            if (!comp(value, first[child])) break;
+            first[i] = std::move(first[child]);
+            i = child;
+        }
+        first[i] = std::move(value);
+    }
+
+    template<typename T, typename Compare>
+    void heap_sort(T *first, T *last, Compare comp) {
+        ptrdiff_t n = last - first;
+        for (ptrdiff_t i = n / 2 - 1; i >= 0; i--) {
+            sift_down(first, i, n, comp);
+        }
+        for (ptrdiff_t i = n - 1; i > 0; i--) {
+            std::iter_swap(first, first + i);
+            sift_down(first, 0, i, comp);
+        }
+    }
+
+    // sorts a nearly sorted range, returns false and leaves it unsorted if too many elements have to move
+    template<typename T, typename Compare>
+    bool partial_insertion_sort(T *first, T *last, Compare comp) {
+        if (first == last) return true;
+        int moved = 0;
+        for (T *i = first + 1; i < last; i++) {
+            if (!comp(*i, *(i - 1))) continue;
+            T value = std::move(*i);
+            T *j = i;
+            do {
+                *j = std::move(*(j - 1));
+                j--;
+            } while (j > first && comp(value, *(j - 1)));
+            *j = std::move(value);
+            moved += i - j;
+            if (moved > PARTIAL_INSERTION_SORT_LIMIT) return false;
+        }
+        return true;
+    }
+
+    /*
+     * Partitions around the pivot *first: elements for which comp(x, pivot) holds go to the left.
+     * Returns the final position of the pivot, already_partitioned is set when no element was swapped.
+     * Every scan stops at an element it has already seen, so comparators which are not strict are safe.
+     */
+    template<typename T, typename Compare>
+    T *partition_right(T *first, T *last, Compare comp, bool &already_partitioned) {
+        T pivot = std::move(*first);
+        T *i = first, *j = last;
+        while (++i < last && comp(*i, pivot));
+        while (--j > i && !comp(*j, pivot));
+        already_partitioned = i >= j;
+        while (i < j) {
+            std::iter_swap(i, j);
+            while (comp(*++i, pivot));
+            while (!comp(*--j, pivot));
+        }
+        T *pivot_pos = i - 1;
+        *first = std::move(*pivot_pos);
+        *pivot_pos = std::move(pivot);
+        return pivot_pos;
+    }
+
+    // moves count elements at left offsets from first to right offsets back from last and vice versa
+    template<typename T>
+    void swap_offsets(T *first, T *last, const unsigned char *offsets_l, const unsigned char *offsets_r,
+                      int count, bool use_swaps) {
+        if (use_swaps) {
+            // both blocks are full, a cyclic permutation would move the same elements as swaps
+            for (int k = 0; k < count; k++) {
+                std::iter_swap(first + offsets_l[k], last - offsets_r[k]);
+            }
+        } else if (count > 0) {
+            T *l = first + offsets_l[0], *r = last - offsets_r[0];
+            T tmp = std::move(*l);
+            *l = std::move(*r);
+            for (int k = 1; k < count; k++) {
+                l = first + offsets_l[k];
+                *r = std::move(*l);
+                r = last - offsets_r[k];
+                *l = std::move(*r);
+            }
+            *r = std::move(tmp);
+        }
+    }
+
+    /*
+     * partition_right after BlockQuicksort: a block of elements from each end is classified first,
+     * offsets of misplaced elements are written at a position advanced by the result of the comparison
+     * without a branch, then the misplaced elements of both blocks are exchanged in bulk.
+     */
+    template<typename T, typename Compare>
+    T *partition_right_branchless(T *first, T *last, Compare comp, bool &already_partitioned) {
+        T pivot = std::move(*first);
+        T *i = first, *j = last;
+        while (++i < last && comp(*i, pivot));
+        while (--j > i && !comp(*j, pivot));
+        already_partitioned = i >= j;
+        if (!already_partitioned) {
+            std::iter_swap(i++, j);
+            alignas(64) unsigned char offsets_l[PARTITION_BLOCK_SIZE];
+            alignas(64) unsigned char offsets_r[PARTITION_BLOCK_SIZE];
+            // offsets count from base_l forwards and from base_r backwards, [i, j) is not classified yet
+            T *base_l = i, *base_r = j;
+            int count_l = 0, count_r = 0, start_l = 0, start_r = 0;
+            while (i < j) {
+                ptrdiff_t unknown = j - i;
+                ptrdiff_t split_l = count_l == 0 ? (count_r == 0 ? unknown / 2 : unknown) : 0;
+                ptrdiff_t split_r = count_r == 0 ? unknown - split_l : 0;
+                int block_l = (int) std::min<ptrdiff_t>(split_l, PARTITION_BLOCK_SIZE);
+                int block_r = (int) std::min<ptrdiff_t>(split_r, PARTITION_BLOCK_SIZE);
+                for (int k = 0; k < block_l; k++) {
+                    offsets_l[count_l] = (unsigned char) k;
+                    count_l += !comp(*i++, pivot);
+                }
+                for (int k = 0; k < block_r;) {
+                    offsets_r[count_r] = (unsigned char) ++k;
+                    count_r += comp(*--j, pivot);
+                }
+
+                int count = std::min(count_l, count_r);
+                swap_offsets(base_l, base_r, offsets_l + start_l, offsets_r + start_r, count, count_l == count_r);
+                count_l -= count;
+                count_r -= count;
+                start_l += count;
+                start_r += count;
+                if (count_l == 0) {
+                    start_l = 0;
+                    base_l = i;
+                }
+                if (count_r == 0) {
+                    start_r = 0;
+                    base_r = j;
+                }
+            }
+
+            // misplaced elements of one side are left, they go to the end of the other one
+            while (count_l > 0) {
+                std::iter_swap(base_l + offsets_l[start_l + --count_l], --j);
+                i = j;
+            }
+            while (count_r > 0) {
+                std::iter_swap(base_r - offsets_r[start_r + --count_r], i++);
+            }
+        }
+        T *pivot_pos = i - 1;
+        *first = std::move(*pivot_pos);
+        *pivot_pos = std::move(pivot);
+        return pivot_pos;
+    }
+
+    // elements equal to the pivot *first go to the left, returns the position of the last of them
+    template<typename T, typename Compare>
+    T *partition_left(T *first, T *last, Compare comp) {
+        T pivot = std::move(*first);
+        T *i = first, *j = last;
+        while (--j > first && comp(pivot, *j));
+        while (++i < j && !comp(pivot, *i));
+        while (i < j) {
+            std::iter_swap(i, j);
+            while (comp(pivot, *--j));
+            while (!comp(pivot, *++i));
+        }
+        *first = std::move(*j);
+        *j = std::move(pivot);
+        return j;
+    }
 
-            if (use_insertion_sort && n <= INSERTION_SORT_LENGTH) {
-                insertion_sort(first, last, comp);
+    // moves the pivot candidate to *first
+    template<typename T, typename Compare>
+    void choose_pivot(T *first, T *last, Compare comp) {
+        ptrdiff_t n = last - first, half = n / 2;
+        if (n > NINTHER_THRESHOLD) {
+            sort3(first[0], first[half], last[-1], comp);
+            sort3(first[1], first[half - 1], last[-2], comp);
+            sort3(first[2], first[half + 1], last[-3], comp);
+            sort3(first[half - 1], first[half], first[half + 1], comp);
+            std::iter_swap(first, first + half);
+        } else {
+            sort3(first[half], first[0], last[-1], comp);
+        }
+    }
+
+    // swaps a few elements of a part left after a bad partition, so the same pattern does not repeat
+    template<typename T>
+    void break_patterns(T *first, T *last) {
+        ptrdiff_t n = last - first;
+        if (n < INSERTION_SORT_LENGTH) return;
+        std::iter_swap(first, first + n / 4);
+        std::iter_swap(last - 1, last - n / 4);
+        if (n > NINTHER_THRESHOLD) {
+            std::iter_swap(first + 1, first + (n / 4 + 1));
+            std::iter_swap(first + 2, first + (n / 4 + 2));
+            std::iter_swap(last - 2, last - (n / 4 + 1));
+            std::iter_swap(last - 3, last - (n / 4 + 2));
+        }
+    }
+
+    /*
+     * Pattern defeating quicksort: a part which is not leftmost has a predecessor not greater than
+     * any of its elements, so a pivot equal to it means a run of equal elements, which is skipped at once.
+     * A partition without swaps hints at sorted input, which is then finished by insertion sorts.
+     * Every highly unbalanced partition spends one of bad_allowed, then the range is heap sorted.
+     * Branchless selects partition_right_branchless.
+     */
+    template<bool Branchless, typename T, typename Compare>
+    void pdq_sort(T *first, T *last, Compare comp, int bad_allowed, bool leftmost) {
+        while (true) {
+            ptrdiff_t n = last - first;
+            if (use_insertion_sort && n <= (Branchless ? NETWORK_SORT_LENGTH : INSERTION_SORT_LENGTH)) {
+                leaf_sort(first, last, comp,
+                          std::integral_constant<bool, Branchless && has_sorting_network<T>::value>());
+                return;
+            }
+            if (n < 3) {
+                if (n == 2 && comp(first[1], first[0])) std::iter_swap(first, first + 1);
                 return;
             }
 
-            T a0 = *first, a1 = *(last - 1), a2 = *(first + n / 2);
-            sort3(a0, a1, a2, comp);
+            choose_pivot(first, last, comp);
+            if (!leftmost && !comp(*(first - 1), *first)) {
+                first = partition_left(first, last, comp) + 1;
+                continue;
+            }
 
-            T *f = first, *l = last;
-            partition(f, l, a1, comp);
+            bool already_partitioned;
+            T *pivot_pos = Branchless ? partition_right_branchless(first, last, comp, already_partitioned)
+                                      : partition_right(first, last, comp, already_partitioned);
+            ptrdiff_t left = pivot_pos - first, right = last - (pivot_pos + 1);
+            if (left < n / 8 || right < n / 8) {
+                if (--bad_allowed == 0) {
+                    heap_sort(first, last, comp);
+                    return;
+                }
+                break_patterns(first, pivot_pos);
+                break_patterns(pivot_pos + 1, last);
+            } else if (already_partitioned && partial_insertion_sort(first, pivot_pos, comp) &&
+                       partial_insertion_sort(pivot_pos + 1, last, comp)) {
+                return;
+            }
 
-            if (l - first < last - f) {
-                std::swap(first, f);
+            // the smaller part is sorted recursively, so the stack depth is logarithmic
+            if (left < right) {
+                pdq_sort<Branchless>(first, pivot_pos, comp, bad_allowed, leftmost);
+                first = pivot_pos + 1;
+                leftmost = false;
             } else {
-                std::swap(last, l);
+                pdq_sort<Branchless>(pivot_pos + 1, last, comp, bad_allowed, false);
+                last = pivot_pos;
             }
-            sort(f, l, comp);
         }
     }
+
+    template<typename T, typename Compare>
+    void sort(T *first, T *last, Compare comp) {
+        ptrdiff_t n = last - first;
+        int log2 = 0;
+        while (n >>= 1) log2++;
+        pdq_sort<is_branchless_compare<T, Compare>::value>(first, last, comp, log2 + 1, true);
+    }
 }
 
 #endif //SORT_SORT_H
@@ -0,0 +1,144 @@
+#ifndef SORT_SORTING_NETWORK_H
+#define SORT_SORTING_NETWORK_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <type_traits>
+
+namespace myalg {
+    // the biggest network, ranges up to this length can be sorted by sorting_network_sort
+    const int SORTING_NETWORK_LENGTH = 64;
+
+    /*
+     * b not before a by comp, without a branch: each select is exactly a min or max instruction
+     * for integers with std::less and std::greater. Equal elements must be identical, the first
+     * of two equal ones is copied to both places.
+     */
+    template<typename T, typename Compare>
+    inline void compare_exchange(T &a, T &b, Compare comp) {
+        T x = a, y = b;
+        a = comp(y, x) ? y : x;
+        b = comp(x, y) ? y : x;
+    }
+
+    /*
+     * Bitonic sorting network over N elements, N a power of two. Every step sorts blocks of size k
+     * from sorted halves: the first layer compares mirrored elements of a block, so all comparisons
+     * go the same direction, the others are half cleaners between elements j apart.
+     * All compare exchanges of a layer are independent and the inner loops run over contiguous
+     * elements, so the compiler turns them into vector min and max where it can.
+     */
+    template<int N, typename T, typename Compare>
+    void sorting_network(T *v, Compare comp) {
+        for (int k = 2; k <= N; k *= 2) {
+            for (int block = 0; block < N; block += k) {
+                for (int i = 0; i < k / 2; i++) {
+                    compare_exchange(v[block + i], v[block + k - 1 - i], comp);
+                }
+            }
+            for (int j = k / 4; j > 0; j /= 2) {
+                for (int block = 0; block < N; block += 2 * j) {
+                    for (int i = 0; i < j; i++) {
+                        compare_exchange(v[block + i], v[block + i + j], comp);
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+     * Integer keys the networks sort instead of the values: integers are their own keys, a float or double
+     * maps to a signed integer of its size which orders as it (-0.0 before 0.0, NaNs at the ends), so equal
+     * keys are identical and min and max of keys are exact.
+     */
+    template<typename T, typename = void>
+    struct network_key;
+
+    template<typename T>
+    struct network_key<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+        typedef T type;
+
+        static inline T to(T x) {
+            return x;
+        }
+
+        static inline T from(T key) {
+            return key;
+        }
+    };
+
+    template<typename F, typename I>
+    struct floating_network_key {
+        typedef I type;
+
+        // the order of negative values is reversed by flipping all bits but the sign, which is an involution
+        static inline I flip(I bits) {
+            return bits ^ (I) ((bits >> (8 * sizeof(I) - 1)) & std::numeric_limits<I>::max());
+        }
+
+        static inline I to(F x) {
+            I bits;
+            std::memcpy(&bits, &x, sizeof(bits));
+            return flip(bits);
+        }
+
+        static inline F from(I key) {
+            I bits = flip(key);
+            F x;
+            std::memcpy(&x, &bits, sizeof(x));
+            return x;
+        }
+    };
+
+    template<>
+    struct network_key<float> : floating_network_key<float, int32_t> {};
+
+    template<>
+    struct network_key<double> : floating_network_key<double, int64_t> {};
+
+    // arithmetic types with a network key, long double has none
+    template<typename T>
+    struct has_sorting_network
+            : std::integral_constant<bool, std::is_integral<T>::value || std::is_same<T, float>::value ||
+                                           std::is_same<T, double>::value> {};
+
+    template<int N, typename T, typename Compare>
+    inline void padded_sorting_network(T *first, T *last, Compare comp) {
+        typedef network_key<T> keys;
+        typedef typename keys::type K;
+        alignas(64) K v[N];
+        ptrdiff_t n = last - first;
+        // comp is std::less or std::greater, so it either sorts keys up or down, padding goes after the others
+        bool ascending = comp(T(0), T(1));
+        K padding = ascending ? std::numeric_limits<K>::max() : std::numeric_limits<K>::lowest();
+        for (ptrdiff_t i = 0; i < N; i++) {
+            v[i] = i < n ? keys::to(first[i]) : padding;
+        }
+        if (ascending) sorting_network<N>(v, std::less<K>());
+        else sorting_network<N>(v, std::greater<K>());
+        for (ptrdiff_t i = 0; i < n; i++) {
+            first[i] = keys::from(v[i]);
+        }
+    }
+
+    /*
+     * Sorts up to SORTING_NETWORK_LENGTH values of a type with has_sorting_network by std::less or std::greater
+     * (comp must be one of them) by the smallest network of 8, 16, 32 or 64 elements which holds them,
+     * the tail of the network is padded by the key sorted last.
+     */
+    template<typename T, typename Compare>
+    void sorting_network_sort(T *first, T *last, Compare comp) {
+        ptrdiff_t n = last - first;
+        assert(n <= SORTING_NETWORK_LENGTH);
+        if (n <= 8) padded_sorting_network<8>(first, last, comp);
+        else if (n <= 16) padded_sorting_network<16>(first, last, comp);
+        else if (n <= 32) padded_sorting_network<32>(first, last, comp);
+        else padded_sorting_network<64>(first, last, comp);
+    }
+}
+
+#endif //SORT_SORTING_NETWORK_H
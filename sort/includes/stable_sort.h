@@ -0,0 +1,288 @@
+#ifndef SORT_STABLE_SORT_H
+#define SORT_STABLE_SORT_H
+
+#include "sort.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace myalg {
+    // shorter natural runs are extended to this length by insertion
+    const ptrdiff_t STABLE_SORT_MIN_RUN = 32;
+    // a merge switches to galloping after this many elements in a row came from the same run
+    const int MIN_GALLOP = 7;
+
+    // first element of a range for which pred does not hold, pred holds for a prefix; exponential search from first
+    template<typename T, typename Pred>
+    T *gallop_from_first(T *first, T *last, Pred pred) {
+        ptrdiff_t n = last - first, prev = 0, ofs = 1;
+        while (ofs <= n && pred(first[ofs - 1])) {
+            prev = ofs;
+            ofs = 2 * ofs + 1;
+        }
+        return std::partition_point(first + prev, first + std::min(ofs - 1, n), pred);
+    }
+
+    // the same as gallop_from_first, exponential search from last
+    template<typename T, typename Pred>
+    T *gallop_from_last(T *first, T *last, Pred pred) {
+        ptrdiff_t n = last - first, prev = 0, ofs = 1;
+        while (ofs <= n && !pred(last[-ofs])) {
+            prev = ofs;
+            ofs = 2 * ofs + 1;
+        }
+        return std::partition_point(ofs <= n ? last - ofs + 1 : first, last - prev, pred);
+    }
+
+    /*
+     * Merges [first, mid) moved to buffer with [mid, last) into [first, last) from the front, TimSort style:
+     * elements are taken one at a time until min_gallop of them in a row came from one run, then whole
+     * blocks are found by galloping until the blocks get short. min_gallop adapts to the data.
+     */
+    template<typename T, typename Compare>
+    void merge_lo(T *first, T *mid, T *last, Compare comp, T *buffer, int &min_gallop) {
+        T *a = buffer, *a_end = std::move(first, mid, buffer), *b = mid, *out = first;
+        // [first, mid) starts with an element after *mid and [mid, last) ends with one after *(mid - 1)
+        *out++ = std::move(*b++);
+        if (b == last) goto done;
+        while (true) {
+            int count_a = 0, count_b = 0;
+            do {
+                if (comp(*b, *a)) {
+                    *out++ = std::move(*b++);
+                    count_b++;
+                    count_a = 0;
+                    if (b == last) goto done;
+                } else {
+                    *out++ = std::move(*a++);
+                    count_a++;
+                    count_b = 0;
+                    if (a == a_end) goto done;
+                }
+            } while ((count_a | count_b) < min_gallop);
+
+            do {
+                T *p = gallop_from_first(a, a_end, [&](const T &x) { return !comp(*b, x); });
+                count_a = (int) std::min<ptrdiff_t>(p - a, MIN_GALLOP);
+                out = std::move(a, p, out);
+                a = p;
+                if (a == a_end) goto done;
+                *out++ = std::move(*b++);
+                if (b == last) goto done;
+
+                T *q = gallop_from_first(b, last, [&](const T &x) { return comp(x, *a); });
+                count_b = (int) std::min<ptrdiff_t>(q - b, MIN_GALLOP);
+                out = std::move(b, q, out);
+                b = q;
+                if (b == last) goto done;
+                *out++ = std::move(*a++);
+                if (a == a_end) goto done;
+                min_gallop = std::max(min_gallop - 1, 1);
+            } while (count_a >= MIN_GALLOP || count_b >= MIN_GALLOP);
+            min_gallop += 2;
+        }
+        done:
+        std::move(a, a_end, out);
+    }
+
+    // merge_lo mirrored: [mid, last) is moved to buffer and the merge runs from the back
+    template<typename T, typename Compare>
+    void merge_hi(T *first, T *mid, T *last, Compare comp, T *buffer, int &min_gallop) {
+        T *a = mid, *b = std::move(mid, last, buffer), *out = last;
+        *--out = std::move(*--a);
+        if (a == first) goto done;
+        while (true) {
+            int count_a = 0, count_b = 0;
+            do {
+                if (comp(*(b - 1), *(a - 1))) {
+                    *--out = std::move(*--a);
+                    count_a++;
+                    count_b = 0;
+                    if (a == first) goto done;
+                } else {
+                    *--out = std::move(*--b);
+                    count_b++;
+                    count_a = 0;
+                    if (b == buffer) goto done;
+                }
+            } while ((count_a | count_b) < min_gallop);
+
+            do {
+                T *p = gallop_from_last(first, a, [&](const T &x) { return !comp(*(b - 1), x); });
+                count_a = (int) std::min<ptrdiff_t>(a - p, MIN_GALLOP);
+                out = std::move_backward(p, a, out);
+                a = p;
+                if (a == first) goto done;
+                *--out = std::move(*--b);
+                if (b == buffer) goto done;
+
+                T *q = gallop_from_last(buffer, b, [&](const T &x) { return comp(x, *(a - 1)); });
+                count_b = (int) std::min<ptrdiff_t>(b - q, MIN_GALLOP);
+                out = std::move_backward(q, b, out);
+                b = q;
+                if (b == buffer) goto done;
+                *--out = std::move(*--a);
+                if (a == first) goto done;
+                min_gallop = std::max(min_gallop - 1, 1);
+            } while (count_a >= MIN_GALLOP || count_b >= MIN_GALLOP);
+            min_gallop += 2;
+        }
+        done:
+        std::move_backward(buffer, b, out);
+    }
+
+    /*
+     * Stable merge of sorted [first, mid) and [mid, last). Elements already in place at both ends are cut off
+     * by galloping, then the shorter run goes to the buffer if it fits. Otherwise the longer run is split
+     * in the middle, the other one at the same value, the middle parts are swapped by a rotation and
+     * both halves are merged the same way, which needs no buffer at all.
+     */
+    template<typename T, typename Compare>
+    void merge_runs(T *first, T *mid, T *last, Compare comp, T *buffer, ptrdiff_t buffer_size, int &min_gallop) {
+        while (first != mid && mid != last) {
+            first = gallop_from_first(first, mid, [&](const T &x) { return !comp(*mid, x); });
+            if (first == mid) return;
+            last = gallop_from_last(mid, last, [&](const T &x) { return comp(x, *(mid - 1)); });
+            if (mid == last) return;
+
+            ptrdiff_t n1 = mid - first, n2 = last - mid;
+            if (n1 <= n2 && n1 <= buffer_size) {
+                merge_lo(first, mid, last, comp, buffer, min_gallop);
+                return;
+            }
+            if (n2 <= buffer_size) {
+                merge_hi(first, mid, last, comp, buffer, min_gallop);
+                return;
+            }
+            if (n1 == 1 && n2 == 1) {
+                std::iter_swap(first, mid);
+                return;
+            }
+            T *cut1, *cut2;
+            if (n1 > n2) {
+                cut1 = first + n1 / 2;
+                cut2 = std::lower_bound(mid, last, *cut1, comp);
+            } else {
+                cut2 = mid + n2 / 2;
+                cut1 = std::upper_bound(first, mid, *cut2, comp);
+            }
+            T *new_mid = std::rotate(cut1, mid, cut2);
+            merge_runs(first, cut1, new_mid, comp, buffer, buffer_size, min_gallop);
+            first = new_mid;
+            mid = cut2;
+        }
+    }
+
+    // end of the natural run at first, a strictly descending one is reversed
+    template<typename T, typename Compare>
+    T *natural_run(T *first, T *last, Compare comp) {
+        T *i = first + 1;
+        if (i == last) return i;
+        if (comp(*i, *first)) {
+            while (++i < last && comp(*i, *(i - 1)));
+            std::reverse(first, i);
+        } else {
+            while (++i < last && !comp(*i, *(i - 1)));
+        }
+        return i;
+    }
+
+    // sorts [first, last) whose prefix up to sorted is sorted already, stable
+    template<typename T, typename Compare>
+    void extend_run(T *first, T *sorted, T *last, Compare comp) {
+        for (T *i = sorted; i < last; i++) {
+            if (!comp(*i, *(i - 1))) continue;
+            T value = std::move(*i);
+            T *j = i;
+            do {
+                *j = std::move(*(j - 1));
+                j--;
+            } while (j > first && comp(value, *(j - 1)));
+            *j = std::move(value);
+        }
+    }
+
+    /*
+     * Depth of the node between neighbour runs [begin, mid) and [mid, end) in the merge tree of powersort:
+     * the first bit in which the binary fractions of their midpoints (begin + mid) / 2n and (mid + end) / 2n differ.
+     */
+    inline int node_power(ptrdiff_t begin, ptrdiff_t mid, ptrdiff_t end, ptrdiff_t n) {
+        uint64_t a = (uint64_t) (begin + mid), b = (uint64_t) (mid + end), twice_n = 2 * (uint64_t) n;
+        int power = 0;
+        while (true) {
+            power++;
+            a *= 2;
+            b *= 2;
+            bool a_bit = a >= twice_n, b_bit = b >= twice_n;
+            if (a_bit != b_bit) return power;
+            if (a_bit) {
+                a -= twice_n;
+                b -= twice_n;
+            }
+        }
+    }
+
+    /*
+     * Stable adaptive merge sort (powersort, as in CPython): natural runs, ascending or strictly descending,
+     * are found left to right and extended to STABLE_SORT_MIN_RUN by insertion, then merged in the order
+     * of a nearly optimal merge tree, so presorted input costs little more than a scan.
+     * buffer of buffer_size elements is scratch space, n / 2 elements let every merge use it, with less
+     * the merges which do not fit go in place by rotations, with none the sort is O(n log^2 n) without allocation.
+     */
+    template<typename T, typename Compare>
+    void stable_sort(T *first, T *last, Compare comp, T *buffer, ptrdiff_t buffer_size) {
+        struct Run {
+            T *begin;
+            int power; // of the node between this run and the one below it in the stack
+        };
+        ptrdiff_t n = last - first;
+        if (n < 2) return;
+        // powers grow up the stack and are at most 64, one more entry is the run on top
+        Run runs[66];
+        int top = 0;
+        int min_gallop = MIN_GALLOP;
+
+        T *begin = first;
+        T *end = natural_run(begin, last, comp);
+        if (end - begin < STABLE_SORT_MIN_RUN) {
+            T *sorted = end;
+            end = std::min(begin + STABLE_SORT_MIN_RUN, last);
+            extend_run(begin, sorted, end, comp);
+        }
+        runs[top++] = Run{begin, 0};
+        while (end < last) {
+            T *next_begin = end;
+            T *next_end = natural_run(next_begin, last, comp);
+            if (next_end - next_begin < STABLE_SORT_MIN_RUN) {
+                T *sorted = next_end;
+                next_end = std::min(next_begin + STABLE_SORT_MIN_RUN, last);
+                extend_run(next_begin, sorted, next_end, comp);
+            }
+            int power = node_power(runs[top - 1].begin - first, next_begin - first, next_end - first, n);
+            // runs on top with a deeper node than the new one are merged into one
+            while (top > 1 && runs[top - 1].power > power) {
+                merge_runs(runs[top - 2].begin, runs[top - 1].begin, end, comp, buffer, buffer_size, min_gallop);
+                top--;
+            }
+            runs[top++] = Run{next_begin, power};
+            end = next_end;
+        }
+        for (; top > 1; top--) {
+            merge_runs(runs[top - 2].begin, runs[top - 1].begin, last, comp, buffer, buffer_size, min_gallop);
+        }
+    }
+
+    // allocates a buffer of n / 2 elements (T must be default constructible), sorts in place if that fails
+    template<typename T, typename Compare>
+    void stable_sort(T *first, T *last, Compare comp) {
+        ptrdiff_t buffer_size = (last - first) / 2;
+        std::unique_ptr<T[]> buffer(new(std::nothrow) T[buffer_size]);
+        stable_sort(first, last, comp, buffer.get(), buffer != nullptr ? buffer_size : 0);
+    }
+}
+
+#endif //SORT_STABLE_SORT_H
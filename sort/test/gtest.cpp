@@ -1,8 +1,16 @@
 #include "gtest/gtest.h"
 #include "sort.h"
+#include "parallel_sort.h"
+#include "radix_sort.h"
+#include "stable_sort.h"
+#include "external_sort.h"
+#include <cmath>
 #include <random>
 #include <chrono>
+#include <cstdio>
 #include <functional>
+#include <string>
+#include <vector>
 
 #define INT_SORT_TEST(testName) template<typename Compare> void testName(void (*sort_function)(int*, int*, Compare), Compare comp)
 
@@ -179,4 +187,446 @@ TEST(quick_sort, random_performance_test) {
     std::cout << "crono: " << time / M << std::endl;
 
     delete[] a;
-}
\ No newline at end of file
+}
+
+// Inputs which drive a median of three quicksort quadratic, every one must stay about n log n comparisons
+TEST(quick_sort, adversarial_patterns_test) {
+    int N = 100000;
+    std::vector<std::vector<int>> patterns(6, std::vector<int>(N));
+    for (int i = 0; i < N; i++) {
+        patterns[0][i] = i;                             // sorted
+        patterns[1][i] = N - i;                         // reversed
+        patterns[2][i] = i < N / 2 ? i : N - i;         // organ pipe
+        patterns[3][i] = i % 16;                        // many duplicates
+        patterns[4][i] = 7;                             // all equal
+        patterns[5][i] = i % 2 ? N / 2 + i / 2 : i / 2; // alternating halves
+    }
+    long long log2 = 0;
+    while ((1 << log2) < N) log2++;
+
+    for (auto &a : patterns) {
+        for (int greater = 0; greater < 2; greater++) {
+            std::vector<int> b = a;
+            long long comparisons = 0;
+            if (greater) {
+                myalg::sort(b.data(), b.data() + N, [&comparisons](int x, int y) {
+                    comparisons++;
+                    return x >= y;
+                });
+                EXPECT_TRUE(std::is_sorted(b.begin(), b.end(), std::greater<int>()));
+            } else {
+                myalg::sort(b.data(), b.data() + N, [&comparisons](int x, int y) {
+                    comparisons++;
+                    return x < y;
+                });
+                EXPECT_TRUE(std::is_sorted(b.begin(), b.end()));
+            }
+            EXPECT_LE(comparisons, 4 * N * log2);
+            std::sort(a.begin(), a.end());
+            std::sort(b.begin(), b.end());
+            EXPECT_EQ(a, b);
+        }
+    }
+}
+
+// Median of three killer by Musser: the pivot is always the second smallest element
+TEST(quick_sort, median_of_three_killer_test) {
+    int N = 1 << 16, K = N / 2;
+    std::vector<int> a(N);
+    for (int i = 1; i <= K; i++) {
+        if (i % 2) {
+            a[i - 1] = i;
+            a[i] = K + i;
+        }
+        a[K + i - 1] = 2 * i;
+    }
+    long long comparisons = 0;
+    myalg::sort(a.data(), a.data() + N, [&comparisons](int x, int y) {
+        comparisons++;
+        return x < y;
+    });
+    EXPECT_TRUE(std::is_sorted(a.begin(), a.end()));
+    EXPECT_LE(comparisons, 4LL * N * 16);
+}
+
+// std::less and std::greater over arithmetic keys take the block partition
+TEST(quick_sort, branchless_partition_test) {
+    EXPECT_TRUE((myalg::is_branchless_compare<int, std::less<int>>::value));
+    EXPECT_TRUE((myalg::is_branchless_compare<double, std::greater<>>::value));
+    EXPECT_FALSE((myalg::is_branchless_compare<std::string, std::less<std::string>>::value));
+
+    std::mt19937 rand(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    for (int N : {100, 1000, 100000}) {
+        for (int range : {2, 1000, 1 << 30}) {
+            std::uniform_int_distribution<int> distribution(0, range - 1);
+            std::vector<int> a(N);
+            for (int &x : a) {
+                x = distribution(rand);
+            }
+            std::vector<int> expected = a;
+            std::sort(expected.begin(), expected.end());
+            std::vector<int> b = a;
+            myalg::sort(b.data(), b.data() + N, std::less<int>());
+            EXPECT_EQ(b, expected);
+            b = a;
+            myalg::sort(b.data(), b.data() + N, std::greater<>());
+            std::reverse(b.begin(), b.end());
+            EXPECT_EQ(b, expected);
+
+            std::vector<double> d(a.begin(), a.end());
+            myalg::sort(d.data(), d.data() + N, std::less<double>());
+            EXPECT_TRUE(std::is_sorted(d.begin(), d.end()));
+        }
+    }
+}
+
+TEST(parallel_sort, random_test) {
+    std::mt19937 rand(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    for (int N : {0, 6, 1 << 20}) {
+        for (int range : {1, 100, 1 << 30}) {
+            std::uniform_int_distribution<int> distribution(0, range - 1);
+            std::vector<int> a(N);
+            for (int &x : a) {
+                x = distribution(rand);
+            }
+            std::vector<int> expected = a;
+            std::sort(expected.begin(), expected.end());
+            for (int threads : {1, 2, 3, 8}) {
+                std::vector<int> b = a;
+                myalg::parallel_sort(b.data(), b.data() + N, LESS, threads);
+                EXPECT_EQ(b, expected);
+                b = a;
+                myalg::parallel_sort(b.data(), b.data() + N, GREATER_EQ, threads);
+                std::reverse(b.begin(), b.end());
+                EXPECT_EQ(b, expected);
+            }
+        }
+    }
+}
+
+TEST(radix_sort, keys_test) {
+    std::mt19937_64 rand(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    for (int N : {0, 10, 100000}) {
+        std::vector<int> a(N);
+        std::vector<uint64_t> b(N);
+        std::vector<float> c(N);
+        std::vector<double> d(N);
+        for (int i = 0; i < N; i++) {
+            a[i] = (int) rand();
+            b[i] = i % 3 ? rand() : rand() % 1000;
+            c[i] = std::uniform_real_distribution<float>(-1e6, 1e6)(rand);
+            d[i] = std::uniform_real_distribution<double>(-1, 1)(rand);
+        }
+        for (int american = 0; american < 2; american++) {
+            std::vector<int> sa = a;
+            std::vector<uint64_t> sb = b;
+            std::vector<float> sc = c;
+            std::vector<double> sd = d;
+            if (american) {
+                myalg::american_flag_sort(sa.data(), sa.data() + N);
+                myalg::american_flag_sort(sb.data(), sb.data() + N);
+                myalg::american_flag_sort(sc.data(), sc.data() + N);
+                myalg::american_flag_sort(sd.data(), sd.data() + N);
+            } else {
+                myalg::radix_sort(sa.data(), sa.data() + N);
+                myalg::radix_sort(sb.data(), sb.data() + N);
+                myalg::radix_sort(sc.data(), sc.data() + N);
+                myalg::radix_sort(sd.data(), sd.data() + N);
+            }
+            std::vector<int> ea = a;
+            std::vector<uint64_t> eb = b;
+            std::vector<float> ec = c;
+            std::vector<double> ed = d;
+            std::sort(ea.begin(), ea.end());
+            std::sort(eb.begin(), eb.end());
+            std::sort(ec.begin(), ec.end());
+            std::sort(ed.begin(), ed.end());
+            EXPECT_EQ(sa, ea);
+            EXPECT_EQ(sb, eb);
+            EXPECT_EQ(sc, ec);
+            EXPECT_EQ(sd, ed);
+        }
+    }
+}
+
+TEST(radix_sort, key_value_test) {
+    std::mt19937 rand(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    // below and above RADIX_SORT_LENGTH, few distinct keys so equal ones are many
+    for (int N : {100, 1000, 1024, 100000}) {
+        std::vector<std::pair<short, int>> a(N);
+        for (int i = 0; i < N; i++) {
+            a[i] = std::make_pair((short) ((int) (rand() % 50) - 25), i);
+        }
+        std::vector<std::pair<short, int>> expected = a;
+        std::stable_sort(expected.begin(), expected.end(),
+                         [](const std::pair<short, int> &x, const std::pair<short, int> &y) {
+                             return x.first < y.first;
+                         });
+
+        std::vector<std::pair<short, int>> b = a;
+        myalg::radix_sort(b.data(), b.data() + N);
+        EXPECT_EQ(b, expected); // stable
+
+        b = a;
+        myalg::american_flag_sort(b.data(), b.data() + N, [](const std::pair<short, int> &x) { return -x.second; });
+        for (int i = 0; i < N; i++) {
+            EXPECT_EQ(b[i].second, N - 1 - i);
+        }
+    }
+}
+
+template<typename T, typename Compare>
+void test_sorting_network(Compare comp) {
+    std::mt19937 rand(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    for (int n = 0; n <= myalg::SORTING_NETWORK_LENGTH; n++) {
+        std::vector<T> a(n);
+        for (T &x : a) {
+            x = (T) (rand() % 20) - 10;
+        }
+        std::vector<T> expected = a;
+        std::sort(expected.begin(), expected.end(), comp);
+        myalg::sorting_network_sort(a.data(), a.data() + n, comp);
+        EXPECT_EQ(a, expected);
+    }
+}
+
+TEST(sorting_network, sizes_test) {
+    test_sorting_network<int>(std::less<int>());
+    test_sorting_network<int>(std::greater<int>());
+    test_sorting_network<int64_t>(std::less<int64_t>());
+    test_sorting_network<float>(std::less<float>());
+    test_sorting_network<double>(std::greater<double>());
+}
+
+// equal elements are exchanged, not overwritten
+TEST(sorting_network, signed_zero_test) {
+    double a[] = {0.0, -0.0, 1.0, -0.0, -1.0};
+    myalg::sorting_network_sort(a, a + 5, std::less<double>());
+    int negative = 0;
+    for (double x : a) {
+        negative += std::signbit(x);
+    }
+    EXPECT_EQ(negative, 3);
+    EXPECT_EQ(a[0], -1.0);
+    EXPECT_EQ(a[4], 1.0);
+}
+
+TEST(stable_sort, small_tests) {
+    test_empty(myalg::stable_sort, LESS);
+    test_sort_one(myalg::stable_sort, GREATER_EQ);
+    test_sort_two(myalg::stable_sort, LESS);
+    test_sort_six(myalg::stable_sort, GREATER_EQ);
+    test_sort_six_with_duplicates(myalg::stable_sort, LESS);
+    test_sort_six_with_duplicates(myalg::stable_sort, GREATER_EQ);
+}
+
+// keys are few, values are the input positions, so a stable sort leaves values of equal keys ascending
+TEST(stable_sort, stability_test) {
+    std::mt19937 rand(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    typedef std::pair<int, int> item;
+    auto by_key = [](const item &x, const item &y) { return x.first < y.first; };
+    for (int N : {10, 100, 1000, 100000}) {
+        for (int keys : {2, 100, 1 << 30}) {
+            for (int pattern = 0; pattern < 3; pattern++) {
+                std::vector<item> a(N);
+                for (int i = 0; i < N; i++) {
+                    int key = (int) (rand() % keys);
+                    // random, runs of ascending and of descending keys
+                    a[i] = std::make_pair(pattern == 0 ? key : pattern == 1 ? i / 1000 * 7 % 5 + key % 2 : -i / 3, i);
+                }
+                std::vector<item> expected = a;
+                std::stable_sort(expected.begin(), expected.end(), by_key);
+                for (ptrdiff_t buffer_size : {N / 2, N / 16, 0}) {
+                    std::vector<item> b = a, buffer(buffer_size);
+                    myalg::stable_sort(b.data(), b.data() + N, by_key, buffer.data(), buffer_size);
+                    EXPECT_EQ(b, expected);
+                }
+                myalg::stable_sort(a.data(), a.data() + N, by_key);
+                EXPECT_EQ(a, expected);
+            }
+        }
+    }
+}
+
+TEST(stable_sort, performance_test) {
+    int N = 1 << 20;
+    std::mt19937 rand(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    std::vector<int> random(N), runs(N);
+    for (int i = 0; i < N; i++) {
+        random[i] = (int) rand();
+        runs[i] = i % 10000 == 0 ? (int) rand() : runs[i - 1] + (int) (rand() % 8);
+    }
+    for (auto *input : {&random, &runs}) {
+        std::vector<int> a = *input, b = *input;
+        auto start = std::chrono::high_resolution_clock::now();
+        myalg::stable_sort(a.data(), a.data() + N, std::less<int>());
+        auto middle = std::chrono::high_resolution_clock::now();
+        std::stable_sort(b.begin(), b.end());
+        auto end = std::chrono::high_resolution_clock::now();
+        EXPECT_EQ(a, b);
+        std::cout << (input == &random ? "random" : "runs") << " myalg: " << (middle - start).count()
+                  << " std: " << (end - middle).count() << std::endl;
+    }
+}
+
+struct record {
+    uint64_t key;
+    uint32_t payload[6];
+};
+
+template<typename T>
+void write_file(const std::string &path, const std::vector<T> &items) {
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    ASSERT_NE(file, nullptr);
+    if (!items.empty()) std::fwrite(items.data(), sizeof(T), items.size(), file);
+    std::fclose(file);
+}
+
+template<typename T>
+std::vector<T> read_file(const std::string &path) {
+    std::vector<T> items;
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    T item;
+    while (file != nullptr && std::fread(&item, sizeof(T), 1, file) == 1) {
+        items.push_back(item);
+    }
+    if (file != nullptr) std::fclose(file);
+    return items;
+}
+
+TEST(external_sort, runs_and_passes_test) {
+    std::string input = testing::TempDir() + "external_sort_input", output = testing::TempDir() + "external_sort_output";
+    std::mt19937_64 rand(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    auto by_key = [](const record &a, const record &b) { return a.key < b.key; };
+    for (int N : {0, 1000, 100000}) {
+        std::vector<record> records(N);
+        for (int i = 0; i < N; i++) {
+            records[i].key = rand() % (N / 2 + 1);
+            records[i].payload[0] = (uint32_t) i;
+        }
+        write_file(input, records);
+        std::vector<record> expected = records;
+        std::stable_sort(expected.begin(), expected.end(), by_key);
+
+        for (int async = 0; async < 2; async++) {
+            // 64K of memory and 4K blocks: runs of 2048 records and merges of up to 15 runs, half of both with async_io
+            myalg::external_sort_options options;
+            options.memory_limit = 1 << 16;
+            options.min_block_size = 1 << 12;
+            options.async_io = async;
+            options.temp_directory = async ? testing::TempDir() : "";
+            myalg::external_sort_stats stats;
+            ASSERT_TRUE(myalg::external_sort<record>(input.c_str(), output.c_str(), by_key, options, &stats));
+            std::vector<record> sorted = read_file<record>(output);
+            ASSERT_EQ((int) sorted.size(), N);
+            for (int i = 0; i < N; i++) {
+                EXPECT_EQ(sorted[i].key, expected[i].key);
+            }
+            std::vector<uint32_t> payloads;
+            for (const record &r : sorted) {
+                payloads.push_back(r.payload[0]);
+            }
+            std::sort(payloads.begin(), payloads.end());
+            for (int i = 0; i < N; i++) {
+                EXPECT_EQ(payloads[i], (uint32_t) i);
+            }
+            EXPECT_EQ(stats.records, (size_t) N);
+            EXPECT_EQ(stats.bytes, N * sizeof(record));
+            if (N == 100000) {
+                EXPECT_GT(stats.merge_passes, 1u);
+            }
+        }
+    }
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+}
+
+TEST(external_sort, merge_passes_test) {
+    std::string input = testing::TempDir() + "external_sort_input", output = testing::TempDir() + "external_sort_output";
+    // runs of 1000 records, min_block_size sets the fan in: 8000 / 727 - 1 = 10, 8000 / 2000 - 1 = 3
+    struct config {
+        int records;
+        size_t min_block_size;
+        size_t runs;
+        size_t merge_passes;
+    };
+    for (config c : {config{500, 727, 1, 0}, config{5000, 727, 5, 1}, config{100000, 727, 100, 2},
+                     config{25000, 727, 25, 2}, config{27000, 2000, 27, 3}}) {
+        std::vector<uint64_t> keys(c.records);
+        for (int i = 0; i < c.records; i++) {
+            keys[i] = (uint64_t) (c.records - i);
+        }
+        write_file(input, keys);
+        myalg::external_sort_options options;
+        options.memory_limit = 8000;
+        options.min_block_size = c.min_block_size;
+        options.async_io = false;
+        myalg::external_sort_stats stats;
+        ASSERT_TRUE(myalg::external_sort<uint64_t>(input.c_str(), output.c_str(), std::less<uint64_t>(), options,
+                                                   &stats));
+        std::vector<uint64_t> sorted = read_file<uint64_t>(output);
+        std::sort(keys.begin(), keys.end());
+        EXPECT_EQ(sorted, keys);
+        EXPECT_EQ(stats.runs, c.runs);
+        EXPECT_EQ(stats.merge_passes, c.merge_passes);
+    }
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+}
+
+TEST(external_sort, errors_test) {
+    std::string input = testing::TempDir() + "external_sort_input", output = testing::TempDir() + "external_sort_output";
+    std::remove(input.c_str());
+    EXPECT_FALSE(myalg::external_sort<int>(input.c_str(), output.c_str(), std::less<int>()));
+
+    // a partial record at the end
+    write_file(input, std::vector<char>(4 * 1000 + 2));
+    EXPECT_FALSE(myalg::external_sort<int>(input.c_str(), output.c_str(), std::less<int>()));
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+}
+
+TEST(external_sort, in_place_test) {
+    std::string path = testing::TempDir() + "external_sort_input";
+    std::vector<int> keys(10000);
+    for (size_t i = 0; i < keys.size(); i++) {
+        keys[i] = (int) (i * 7919 % keys.size());
+    }
+    write_file(path, keys);
+    ASSERT_TRUE(myalg::external_sort<int>(path.c_str(), path.c_str(), std::less<int>()));
+    std::vector<int> sorted = read_file<int>(path);
+    std::sort(keys.begin(), keys.end());
+    EXPECT_EQ(sorted, keys);
+
+    // the output of a failed sort is left as it was
+    std::string input = testing::TempDir() + "external_sort_partial";
+    write_file(input, std::vector<char>(4 * 1000 + 2));
+    EXPECT_FALSE(myalg::external_sort<int>(input.c_str(), path.c_str(), std::less<int>()));
+    EXPECT_EQ(read_file<int>(path), keys);
+    std::remove(input.c_str());
+    std::remove(path.c_str());
+}
+
+TEST(external_sort, throughput_test) {
+    std::string input = testing::TempDir() + "external_sort_input", output = testing::TempDir() + "external_sort_output";
+    int N = 1 << 23;
+    std::mt19937_64 rand(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    std::vector<uint64_t> keys(N);
+    for (uint64_t &key : keys) {
+        key = rand();
+    }
+    write_file(input, keys);
+    myalg::external_sort_options options;
+    options.memory_limit = 8 << 20;
+    options.min_block_size = 128 << 10;
+    myalg::external_sort_stats stats;
+    ASSERT_TRUE(myalg::external_sort<uint64_t>(input.c_str(), output.c_str(), std::less<uint64_t>(), options, &stats));
+    std::vector<uint64_t> sorted = read_file<uint64_t>(output);
+    EXPECT_TRUE(std::is_sorted(sorted.begin(), sorted.end()));
+    EXPECT_EQ(sorted.size(), keys.size());
+    std::cout << "runs: " << stats.runs << " passes: " << stats.merge_passes << " run phase: " << stats.run_seconds
+              << "s merge phase: " << stats.merge_seconds << "s throughput: " << stats.throughput() / (1 << 20)
+              << " MB/s" << std::endl;
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+}
@@ -6,6 +6,9 @@
 #define ALGORITHMS_TREE_H
 
 #include <algorithm>
+#include <cassert>
+#include <memory>
+#include <utility>
 
 namespace myalg {
     template<typename K, typename V>
@@ -103,14 +106,21 @@ namespace myalg {
 
     public:
 
-        void del_rec() {
+        template<typename NodeAlloc>
+        static void del_node(node *n, NodeAlloc &alloc) {
+            std::allocator_traits<NodeAlloc>::destroy(alloc, n);
+            std::allocator_traits<NodeAlloc>::deallocate(alloc, n, 1);
+        }
+
+        template<typename NodeAlloc>
+        void del_rec(NodeAlloc &alloc) {
             if (r) {
-                r->del_rec();
-                delete r;
+                r->del_rec(alloc);
+                del_node(r, alloc);
             }
             if (l) {
-                l->del_rec();
-                delete l;
+                l->del_rec(alloc);
+                del_node(l, alloc);
             }
         }
 
@@ -142,11 +152,13 @@ namespace myalg {
             return n;
         }
 
-        static node* add(node *&n, const K &k, const V &v) {
-            if (!n)
-                n = new node<K, V>(k, v);
-            else
-                add(k > n->k ? n->r : n->l, k, v)->p = n;
+        template<typename NodeAlloc>
+        static node* add(node *&n, const K &k, const V &v, NodeAlloc &alloc) {
+            if (!n) {
+                n = std::allocator_traits<NodeAlloc>::allocate(alloc, 1);
+                std::allocator_traits<NodeAlloc>::construct(alloc, n, k, v);
+            } else
+                add(k > n->k ? n->r : n->l, k, v, alloc)->p = n;
             assert(!(n->r) || n->k < n->r->k && n->r->p == n);
             assert(!(n->l) || n->k > n->l->k && n->l->p == n);
             return n = relax(n);
@@ -157,12 +169,13 @@ namespace myalg {
             return find(k > n->k ? n->r : n->l, k);
         }
 
-        static bool del(node *& root, node *n) {
+        template<typename NodeAlloc>
+        static bool del(node *& root, node *n, NodeAlloc &alloc) {
             if (!n) return false;
             if (n->l && n->r) {
                 node *next = node::next(n);
                 data_swap(n, next);
-                return del(root, next);
+                return del(root, next, alloc);
             }
             node *p = n->p;
             node *child = n->l ? n->l : n->r;
@@ -170,7 +183,7 @@ namespace myalg {
             if (p) {
                 (p->l == n ? p->l : p->r) = child;
             }
-            delete n;
+            del_node(n, alloc);
             root = child;
             while (p) {
                 p = (root = relax(p))->p;
@@ -180,9 +193,15 @@ namespace myalg {
         }
     };
 
-    template<typename K, typename V>
+    /*
+     * Alloc is a standard allocator of key value pairs, it is rebound to allocate tree nodes one at a time
+     */
+    template<typename K, typename V, typename Alloc = std::allocator<std::pair<const K, V>>>
     class Dictionary {
         typedef node<K, V> my_node;
+        typedef typename std::allocator_traits<Alloc>::template rebind_alloc<my_node> node_alloc;
+
+        node_alloc alloc;
 
         my_node* root = nullptr;
 
@@ -190,15 +209,17 @@ namespace myalg {
 
     private:
         void put_new(const K &k, const V &v) {
-            root = my_node::add(root, k, v);
+            root = my_node::add(root, k, v, alloc);
             my_size++;
         }
 
     public:
+        explicit Dictionary(const Alloc &alloc = Alloc()) : alloc(alloc) {}
+
         ~Dictionary() {
             if (root) {
-                root->del_rec();
-                delete root;
+                root->del_rec(alloc);
+                my_node::del_node(root, alloc);
             }
         }
 
@@ -212,7 +233,7 @@ namespace myalg {
         }
 
         void remove(const K &k) {
-            if (my_node::del(root, find(k))) {
+            if (my_node::del(root, find(k), alloc)) {
                 my_size--;
             }
         }